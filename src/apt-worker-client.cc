@@ -49,6 +49,8 @@ int apt_worker_out_fd = -1;
 int apt_worker_in_fd = -1;
 int apt_worker_cancel_fd = -1;
 int apt_worker_status_fd = -1;
+int apt_worker_query_out_fd = -1;
+int apt_worker_query_in_fd = -1;
 GPid apt_worker_pid;
 
 gboolean apt_worker_started = FALSE;
@@ -84,6 +86,12 @@ interpret_pmstatus (char *str)
       set_entertainment_fun (NULL, op_general, (int)percentage, 100);
       set_entertainment_cancel (NULL, NULL);
     }
+  else if (!strncmp (str, "pmeta:", 6))
+    {
+      /* The worker's estimate of the remaining seconds.
+       */
+      set_entertainment_eta (atoi (str + 6));
+    }
 }
 
 static gboolean
@@ -189,6 +197,26 @@ add_apt_worker_handler ()
   g_io_channel_unref (channel);
 }
 
+static void handle_one_query_response ();
+
+static gboolean
+handle_apt_worker_query (GIOChannel *channel, GIOCondition cond,
+			 gpointer data)
+{
+  handle_one_query_response ();
+  return apt_worker_query_in_fd >= 0;
+}
+
+static void
+add_apt_worker_query_handler ()
+{
+  GIOChannel *channel = g_io_channel_unix_new (apt_worker_query_in_fd);
+  g_io_add_watch (channel,
+		  GIOCondition (G_IO_IN | G_IO_HUP | G_IO_ERR),
+		  handle_apt_worker_query, NULL);
+  g_io_channel_unref (channel);
+}
+
 static void
 notice_apt_worker_failure ()
 {
@@ -201,6 +229,8 @@ notice_apt_worker_failure ()
   apt_worker_in_fd = -1;
   apt_worker_out_fd = -1;
   apt_worker_cancel_fd = -1;
+  apt_worker_query_in_fd = -1;
+  apt_worker_query_out_fd = -1;
 
   cancel_all_pending_worker_calls ();
 
@@ -246,7 +276,9 @@ start_apt_worker (void)
   if (!must_mkfifo ("/tmp/apt-worker.to", 0600)
       || !must_mkfifo ("/tmp/apt-worker.from", 0600)
       || !must_mkfifo ("/tmp/apt-worker.status", 0600)
-      || !must_mkfifo ("/tmp/apt-worker.cancel", 0600))
+      || !must_mkfifo ("/tmp/apt-worker.cancel", 0600)
+      || !must_mkfifo ("/tmp/apt-worker.qto", 0600)
+      || !must_mkfifo ("/tmp/apt-worker.qfrom", 0600))
     return false;
 
   if (!running_in_scratchbox ())
@@ -263,6 +295,7 @@ start_apt_worker (void)
     "/tmp/apt-worker.to", "/tmp/apt-worker.from",
     "/tmp/apt-worker.status", "/tmp/apt-worker.cancel",
     options,
+    "/tmp/apt-worker.qto", "/tmp/apt-worker.qfrom",
     NULL
   };
 
@@ -289,13 +322,17 @@ start_apt_worker (void)
 					 O_RDONLY);
   apt_worker_status_fd = must_open_nonblock ("/tmp/apt-worker.status", 
 					     O_RDONLY);
-  if (apt_worker_in_fd < 0 || apt_worker_status_fd < 0)
+  apt_worker_query_in_fd = must_open_nonblock ("/tmp/apt-worker.qfrom",
+					       O_RDONLY);
+  if (apt_worker_in_fd < 0 || apt_worker_status_fd < 0
+      || apt_worker_query_in_fd < 0)
     return false;
 
   log_from_fd (stdout_fd);
   log_from_fd (stderr_fd);
   setup_pmstatus_from_fd (apt_worker_status_fd);
   add_apt_worker_handler ();
+  add_apt_worker_query_handler ();
 
   apt_worker_started = TRUE;
 
@@ -307,9 +344,15 @@ static void maybe_send_one_worker_call ();
 static void
 finish_apt_worker_startup ()
 {
+  /* The query fifo is opened first so that it is ready by the time
+     the apt-worker sees its main input fifo opened.
+  */
+  apt_worker_query_out_fd = must_open ("/tmp/apt-worker.qto", O_WRONLY);
   apt_worker_out_fd = must_open ("/tmp/apt-worker.to", O_WRONLY);
   apt_worker_cancel_fd = must_open ("/tmp/apt-worker.cancel", O_WRONLY);
 
+  must_unlink ("/tmp/apt-worker.qto");
+  must_unlink ("/tmp/apt-worker.qfrom");
   must_unlink ("/tmp/apt-worker.to");
   must_unlink ("/tmp/apt-worker.from");
   must_unlink ("/tmp/apt-worker.status");
@@ -378,13 +421,13 @@ cancel_apt_worker ()
 }
 
 static bool
-must_read (void *buf, size_t n)
+must_read (int fd, void *buf, size_t n)
 {
   int r;
 
   while (n > 0)
     {
-      r = read (apt_worker_in_fd, buf, n);
+      r = read (fd, buf, n);
       if (r < 0)
 	{
 	  log_perror ("read");
@@ -402,13 +445,13 @@ must_read (void *buf, size_t n)
 }
 
 static bool
-must_write (void *buf, int n)
+must_write (int fd, void *buf, int n)
 {
   int r;
 
   while (n > 0)
     {
-      r = write (apt_worker_out_fd, buf, n);
+      r = write (fd, buf, n);
       if (r < 0)
 	{
 	  log_perror ("write");
@@ -432,10 +475,10 @@ apt_worker_is_running ()
 }
 
 static bool
-send_apt_worker_request (int cmd, int seq, char *data, int len)
+send_apt_worker_request (int fd, int cmd, int seq, char *data, int len)
 {
   apt_request_header req = { cmd, seq, len };
-  return must_write (&req, sizeof (req)) &&  must_write (data, len);
+  return must_write (fd, &req, sizeof (req)) &&  must_write (fd, data, len);
 }
 
 static int
@@ -463,6 +506,12 @@ struct worker_call {
 static worker_call *pending_calls, **pending_tail = &pending_calls;
 static worker_call *active_call;
 
+/* While the apt-worker is busy installing or removing packages, it
+   can still answer a few read-only requests on its query fifos.  At
+   most one such call is outstanding at any time.
+*/
+static worker_call *active_query_call;
+
 static worker_call *
 get_next_pending_worker_call ()
 {
@@ -499,7 +548,8 @@ maybe_send_one_worker_call ()
       if (c == NULL)
         return;
 
-      if (!send_apt_worker_request (c->cmd, c->seq, c->data, c->len))
+      if (!send_apt_worker_request (apt_worker_out_fd,
+				    c->cmd, c->seq, c->data, c->len))
         {
           what_the_fock_p ();
           cancel_worker_call (c);
@@ -513,6 +563,54 @@ maybe_send_one_worker_call ()
     }
 }
 
+static bool
+is_query_call (int cmd)
+{
+  return (cmd == APTCMD_GET_PACKAGE_LIST
+	  || cmd == APTCMD_GET_PACKAGE_DETAILS
+	  || cmd == APTCMD_GET_CATALOGUES);
+}
+
+/* Send the request CMD directly over the query fifos when the main
+   fifos are blocked by a long operation.  Returns true when the
+   call has been taken care of.
+*/
+static bool
+maybe_send_query_call (int cmd, char *data, int len,
+		       apt_worker_callback *done_callback,
+		       void *done_data)
+{
+  if (!apt_worker_ready
+      || apt_worker_query_out_fd < 0
+      || active_query_call != NULL
+      || !is_query_call (cmd)
+      || active_call == NULL
+      || (active_call->cmd != APTCMD_INSTALL_PACKAGE
+	  && active_call->cmd != APTCMD_REMOVE_PACKAGE))
+    return false;
+
+  worker_call *c = new worker_call;
+  c->next = NULL;
+  c->cmd = cmd;
+  c->seq = next_seq ();
+  c->data = NULL;
+  c->len = 0;
+  c->done_callback = done_callback;
+  c->done_data = done_data;
+
+  if (!send_apt_worker_request (apt_worker_query_out_fd,
+				cmd, c->seq, data, len))
+    {
+      /* Leave it to the main fifos.
+       */
+      delete c;
+      return false;
+    }
+
+  active_query_call = c;
+  return true;
+}
+
 // @todo should this function be exported? It used to have a different
 // signature!! 
 void
@@ -533,6 +631,9 @@ call_apt_worker (int cmd, char *data, int len,
       return;
     }
 
+  if (maybe_send_query_call (cmd, data, len, done_callback, done_data))
+    return;
+
   worker_call *c = new worker_call;
   c->cmd = cmd;
   c->seq = next_seq ();
@@ -569,6 +670,12 @@ cancel_all_pending_worker_calls ()
       active_call = NULL;
     }
 
+  if (active_query_call)
+    {
+      cancel_worker_call (active_query_call);
+      active_query_call = NULL;
+    }
+
   worker_call *c;
   while ((c = get_next_pending_worker_call ()))
     cancel_worker_call (c);
@@ -586,7 +693,7 @@ handle_one_apt_worker_response ()
 
   assert (!running);
     
-  if (!must_read (&res, sizeof (res)))
+  if (!must_read (apt_worker_in_fd, &res, sizeof (res)))
     {
       notice_apt_worker_failure ();
       return;
@@ -602,7 +709,7 @@ handle_one_apt_worker_response ()
       response_len = res.len;
     }
 
-  if (!must_read (response_data, res.len))
+  if (!must_read (apt_worker_in_fd, response_data, res.len))
     {
       notice_apt_worker_failure ();
       return;
@@ -638,6 +745,54 @@ handle_one_apt_worker_response ()
   maybe_send_one_worker_call ();
 }
 
+static void
+handle_one_query_response ()
+{
+  static apt_response_header res;
+  static char *response_data = NULL;
+  static int response_len = 0;
+  static apt_proto_decoder dec;
+
+  if (!must_read (apt_worker_query_in_fd, &res, sizeof (res)))
+    {
+      notice_apt_worker_failure ();
+      return;
+    }
+
+  if (response_len < res.len)
+    {
+      if (response_data)
+	delete[] response_data;
+      response_data = new char[res.len];
+      response_len = res.len;
+    }
+
+  if (!must_read (apt_worker_query_in_fd, response_data, res.len))
+    {
+      notice_apt_worker_failure ();
+      return;
+    }
+
+  /* The progress of a query must not disturb the progress of the
+     operation that is running on the main fifos.
+  */
+  if (res.cmd == APTCMD_STATUS)
+    return;
+
+  if (active_query_call == NULL || active_query_call->seq != res.seq)
+    {
+      fprintf (stderr, "ignoring out of sequence query reply.\n");
+      return;
+    }
+
+  dec.reset (response_data, res.len);
+
+  worker_call *c = active_query_call;
+  active_query_call = NULL;
+  c->done_callback (res.cmd, &dec, c->done_data);
+  delete c;
+}
+
 static apt_proto_encoder request;
 
 typedef struct {
@@ -754,6 +909,21 @@ apt_worker_get_package_info (const char *package,
                    callback, data);
 }
 
+void
+apt_worker_get_package_infos (const char **packages,
+			      bool only_installable_info,
+			      apt_worker_callback *callback, void *data)
+{
+  request.reset ();
+  request.encode_int (only_installable_info);
+  for (int i = 0; packages[i]; i++)
+    request.encode_string (packages[i]);
+  request.encode_string (NULL);
+  call_apt_worker (APTCMD_GET_PACKAGE_INFOS,
+                   request.get_buf (), request.get_len (),
+                   callback, data);
+}
+
 void
 apt_worker_get_package_details (const char *package,
 				const char *version,
@@ -874,9 +1044,14 @@ apt_worker_remove_package (const char *package,
 }
 
 void
-apt_worker_clean (apt_worker_callback *callback, void *data)
+apt_worker_clean (int64_t budget,
+		  apt_worker_callback *callback, void *data)
 {
-  call_apt_worker (APTCMD_CLEAN, NULL, 0, callback, data);
+  request.reset ();
+  request.encode_int64 (budget);
+  call_apt_worker (APTCMD_CLEAN,
+		   request.get_buf (), request.get_len (),
+		   callback, data);
 }
 
 void
@@ -93,6 +93,13 @@ void apt_worker_get_package_info (const char *package,
 				  apt_worker_callback *callback,
 				  void *data);
 
+/* PACKAGES is a NULL terminated array of package names.
+ */
+void apt_worker_get_package_infos (const char **packages,
+				   bool only_installable_info,
+				   apt_worker_callback *callback,
+				   void *data);
+
 void apt_worker_get_package_details (const char *package,
 				     const char *version,
 				     int summary_kind,
@@ -123,7 +130,8 @@ void apt_worker_remove_package (const char *package,
 				apt_worker_callback *callback,
 				void *data);
 
-void apt_worker_clean (apt_worker_callback *callback,
+void apt_worker_clean (int64_t budget,
+		       apt_worker_callback *callback,
 		       void *data);
 
 void apt_worker_install_file (const char *filename,
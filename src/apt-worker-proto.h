@@ -72,6 +72,8 @@ enum apt_command {
 
   APTCMD_EXIT,
 
+  APTCMD_GET_PACKAGE_INFOS,
+
   APTCMD_MAX
 };
 
@@ -312,6 +314,17 @@ struct apt_proto_package_info {
   int64_t remove_user_size_delta;
 };
 
+// GET_PACKAGE_INFOS - GET_PACKAGE_INFO for a batch of packages.
+//
+// Parameters:
+//
+// - only_installable_info (int).
+// - names (string)*,(null).
+//
+// Response:
+//
+// - info (apt_proto_package_info)*, one for each name, in order.
+
 // GET_PACKAGE_DETAILS - get a lot of details about a specific
 //                       package.  This is intended for the "Details"
 //                       dialog, of course.
@@ -421,13 +434,23 @@ enum apt_proto_pkgtrust {
 // - success (int).
 
 
-// CLEAN - empty the cache of downloaded archives
+// CLEAN - empty or trim the cache of downloaded archives
 //
-// No parameters.
+// Parameters:
+//
+// - budget (int64).  When negative, the cache is emptied completely.
+//   Otherwise, the least recently used archives are removed until the
+//   cache occupies at most BUDGET bytes.  Archives of available
+//   updates are kept in that case.
 //
 // Response:
 //
 // - success (int).
+// - hits (int).  Archives that were found in the cache when needed.
+// - misses (int).  Archives that had to be downloaded.
+// - hit_bytes (int64).
+// - miss_bytes (int64).
+// - remaining (int64).  The size of the cache after trimming it.
 
 
 // GET_FILE_DETAILS - Get details about a package in a .deb file.
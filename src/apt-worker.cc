@@ -50,6 +50,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdarg.h>
@@ -57,13 +58,19 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <dirent.h>
 #include <signal.h>
 #include <ftw.h>
+#include <libintl.h>
+#include <utime.h>
 
 #include <fstream>
+#include <map>
+#include <vector>
 
 #include <apt-pkg/init.h>
 #include <apt-pkg/error.h>
@@ -87,6 +94,7 @@
 #include <apt-pkg/policy.h>
 #include <apt-pkg/hashes.h>
 #include <apt-pkg/fileutl.h>
+#include <apt-pkg/aptconfiguration.h>
 #include <apt-pkg/progress.h>
 #include <apt-pkg/install-progress.h>
 
@@ -160,6 +168,10 @@ static xexp *read_operation_record ();
  */
 #define RESCUE_RESULT_FILE "/var/lib/hildon-application-manager/rescue-result"
 
+/* How long unpacking and configuring packages took in the past
+ */
+#define PACKAGE_TIMINGS_FILE "/var/lib/hildon-application-manager/package-timings"
+
 
 /* You know what this means.
  */
@@ -190,6 +202,13 @@ bool flag_allow_wrong_domains = false;
 */
 bool flag_use_apt_algorithms = false;
 
+/* Setting this to true will start installing packages while the
+   archives for later packages are still being downloaded.
+   APTCMD_DOWNLOAD_PACKAGE then only picks the place for the archives
+   and leaves the downloading to APTCMD_INSTALL_PACKAGE.
+*/
+bool flag_pipelined_install = false;
+
 /* Setting this to false will not use MMC to save the packages when
    downloading them.
 */
@@ -393,19 +412,84 @@ AptWorkerCache::Initialize (void)
       global_initialized = true;
     }
 
-  current = new AptWorkerCache;
+  if (current == NULL)
+    current = new AptWorkerCache;
 }
   
-/* This struct describes some status flags for specific packages.
- * myCacheFile includes an array of these, with an entry per
- * package.
+/* A set of packages, stored as one bit per package ID.  Clearing
+ * the whole set is a memset and looking for members skips over
+ * whole words of non-members at a time.
  */
-struct extra_info_struct
-{
-  bool autoinst : 1;
-  bool related : 1;
-  bool soft : 1;
-  domain_t cur_domain, new_domain;
+class package_set {
+
+public:
+  package_set ()
+    : words (NULL), n_words (0)
+  {
+  }
+
+  ~package_set ()
+  {
+    delete[] words;
+  }
+
+  void init (int package_count)
+  {
+    delete[] words;
+    n_words = (package_count + WORD_BITS - 1) / WORD_BITS;
+    words = new unsigned long[n_words];
+    clear ();
+  }
+
+  bool contains (int id) const
+  {
+    return (words[id / WORD_BITS] >> (id % WORD_BITS)) & 1;
+  }
+
+  void set (int id, bool val)
+  {
+    if (val)
+      words[id / WORD_BITS] |= 1UL << (id % WORD_BITS);
+    else
+      words[id / WORD_BITS] &= ~(1UL << (id % WORD_BITS));
+  }
+
+  void clear ()
+  {
+    memset (words, 0, n_words * sizeof (unsigned long));
+  }
+
+  bool operator== (const package_set &other) const
+  {
+    return (n_words == other.n_words
+	    && memcmp (words, other.words,
+		       n_words * sizeof (unsigned long)) == 0);
+  }
+
+  /* Return the smallest member that is not smaller than FROM, or -1
+     if there is none.
+  */
+  int next (int from) const
+  {
+    int w = from / WORD_BITS;
+    if (w >= n_words)
+      return -1;
+
+    unsigned long bits = words[w] & (~0UL << (from % WORD_BITS));
+    while (bits == 0)
+      {
+	if (++w >= n_words)
+	  return -1;
+	bits = words[w];
+      }
+    return w * WORD_BITS + __builtin_ctzl (bits);
+  }
+
+private:
+  static const int WORD_BITS = 8 * sizeof (unsigned long);
+
+  unsigned long *words;
+  int n_words;
 };
 
 class myPolicy : public pkgPolicy {
@@ -426,6 +510,144 @@ public:
   virtual pkgCache::VerIterator GetCandidateVer(pkgCache::PkgIterator Pkg);
 };
 
+/* A pkgDepCache whose 'desired' state can be saved and restored in
+   bulk.  Every simulation starts from the state right after
+   CACHE_INIT, and copying that state back is much cheaper than
+   undoing a simulation package by package with MarkKeep.
+
+   All marking in apt-worker goes through the lower-case wrappers
+   below instead of the Mark* methods of pkgDepCache.  They record
+   that the desired state has changed, which is what tells
+   UPDATE_PACKAGE_SETS to collect its sets again.
+*/
+class myDepCache : public pkgDepCache {
+
+public:
+  myDepCache (pkgCache *cache, Policy *policy)
+    : pkgDepCache (cache, policy),
+      marks_changed (true),
+      saved_pkg_state (NULL), saved_dep_state (NULL)
+  {
+  }
+
+  ~myDepCache ()
+  {
+    delete[] saved_pkg_state;
+    delete[] saved_dep_state;
+  }
+
+  void save_state ();
+  bool restore_state ();
+
+  bool mark_install (const PkgIterator &pkg, bool auto_inst)
+  {
+    marks_changed = true;
+    return MarkInstall (pkg, auto_inst);
+  }
+
+  bool mark_delete (const PkgIterator &pkg, bool purge = false)
+  {
+    marks_changed = true;
+    return MarkDelete (pkg, purge);
+  }
+
+  bool mark_keep (const PkgIterator &pkg, bool soft = false,
+		  bool from_user = true)
+  {
+    marks_changed = true;
+    return MarkKeep (pkg, soft, from_user);
+  }
+
+  void set_reinstall (const PkgIterator &pkg, bool to)
+  {
+    marks_changed = true;
+    SetReInstall (pkg, to);
+  }
+
+  /* The resolver marks packages on its own, so it is run through
+     here as well.
+  */
+  bool resolve (pkgProblemResolver &fix)
+  {
+    marks_changed = true;
+    return fix.Resolve (true);
+  }
+
+  /* Whether the desired state might have changed since the last
+     FORGET_CHANGES.
+  */
+  bool changed ()
+  {
+    return marks_changed;
+  }
+
+  void forget_changes ()
+  {
+    marks_changed = false;
+  }
+
+private:
+  bool marks_changed;
+
+  StateCache *saved_pkg_state;
+  unsigned char *saved_dep_state;
+  double saved_usr_size, saved_download_size;
+  unsigned long saved_inst_count, saved_del_count, saved_keep_count;
+  unsigned long saved_broken_count, saved_policy_broken_count;
+  unsigned long saved_bad_count;
+};
+
+void
+myDepCache::save_state ()
+{
+  unsigned long package_count = Head().PackageCount;
+  unsigned long depends_count = Head().DependsCount;
+
+  if (saved_pkg_state == NULL)
+    {
+      saved_pkg_state = new StateCache[package_count];
+      saved_dep_state = new unsigned char[depends_count];
+    }
+
+  memcpy (saved_pkg_state, PkgState, package_count * sizeof (StateCache));
+  memcpy (saved_dep_state, DepState, depends_count);
+
+  saved_usr_size = iUsrSize;
+  saved_download_size = iDownloadSize;
+  saved_inst_count = iInstCount;
+  saved_del_count = iDelCount;
+  saved_keep_count = iKeepCount;
+  saved_broken_count = iBrokenCount;
+  saved_policy_broken_count = iPolicyBrokenCount;
+  saved_bad_count = iBadCount;
+}
+
+/* Return the cache to the state of the last SAVE_STATE.  Returns
+   false when there is no saved state.
+*/
+bool
+myDepCache::restore_state ()
+{
+  if (saved_pkg_state == NULL)
+    return false;
+
+  memcpy (PkgState, saved_pkg_state,
+	  Head().PackageCount * sizeof (StateCache));
+  memcpy (DepState, saved_dep_state, Head().DependsCount);
+
+  iUsrSize = saved_usr_size;
+  iDownloadSize = saved_download_size;
+  iInstCount = saved_inst_count;
+  iDelCount = saved_del_count;
+  iKeepCount = saved_keep_count;
+  iBrokenCount = saved_broken_count;
+  iPolicyBrokenCount = saved_policy_broken_count;
+  iBadCount = saved_bad_count;
+
+  marks_changed = true;
+  return true;
+}
+
 class myCacheFile : public pkgCacheFile {
 
 public:
@@ -434,16 +656,38 @@ public:
   void load_extra_info ();
   void save_extra_info ();
 
-  extra_info_struct *extra_info;
+  myDepCache *dep_cache ()
+  {
+    return (myDepCache *) DCache;
+  }
+
+  /* Some status flags for specific packages, indexed by package ID.
+   */
+  package_set autoinst, related, soft;
+  domain_t *cur_domain, *new_domain;
+
+  /* The packages, indexed by package ID.  Package IDs are not the
+     positions of the packages in the cache, so the members of a
+     package_set are looked up here.
+   */
+  pkgCache::Package **packages;
+
+  pkgCache::PkgIterator package_by_id (int id)
+  {
+    return pkgCache::PkgIterator (*Cache, packages[id]);
+  }
 
   myCacheFile ()
   {
-    extra_info = NULL;
+    cur_domain = new_domain = NULL;
+    packages = NULL;
   }
 
   ~myCacheFile ()
   {
-    delete[] extra_info;
+    delete[] cur_domain;
+    delete[] new_domain;
+    delete[] packages;
   }
 };
 
@@ -527,7 +771,7 @@ myPolicy::GetCandidateVer (pkgCache::PkgIterator Pkg)
 	    {
 	      if (!domain_dominates_or_is_equal
 		  (pf_domain[VF.File()->ID],
-		   my_cache_file->extra_info[Pkg->ID].cur_domain))
+		   my_cache_file->cur_domain[Pkg->ID]))
 		{
 		  log_stderr ("Ignoring version from wrong domain: %s %s",
 			      Pkg.Name(), Ver.VerStr());
@@ -579,7 +823,7 @@ myCacheFile::Open (OpProgress &Progress, bool WithLock)
   load_extra_info ();
 
   // Create the dependency cache
-  DCache = new pkgDepCache(Cache,Policy);
+  DCache = new myDepCache(Cache,Policy);
   if (_error->PendingError() == true)
     return false;
   
@@ -616,11 +860,11 @@ myCacheFile::save_extra_info ()
 	{
 	  if (cache[pkg].Flags & pkgCache::Flag::Auto)
 	    {
-	      extra_info[pkg->ID].autoinst = true;
+	      autoinst.set (pkg->ID, true);
 	      fprintf (f, "%s\n", pkg.Name ());
 	    }
 	  else
-	    extra_info[pkg->ID].autoinst = false;
+	    autoinst.set (pkg->ID, false);
 	}
       fflush (f);
       fsync (fileno (f));
@@ -641,7 +885,7 @@ myCacheFile::save_extra_info ()
 	  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
 	       !pkg.end (); pkg++)
 	    {
-	      if (extra_info[pkg->ID].cur_domain == i)
+	      if (cur_domain[pkg->ID] == i)
 		fprintf (f, "%s\n", pkg.Name ());
 	    }
 	  fflush (f);
@@ -661,13 +905,18 @@ myCacheFile::load_extra_info ()
 
   int package_count = cache.Head().PackageCount;
 
-  extra_info = new extra_info_struct[package_count];
+  autoinst.init (package_count);
+  related.init (package_count);
+  soft.init (package_count);
 
-  for (int i = 0; i < package_count; i++)
-    {
-      extra_info[i].autoinst = false;
-      extra_info[i].cur_domain = DOMAIN_DEFAULT;
-    }
+  packages = new pkgCache::Package *[package_count];
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    packages[pkg->ID] = pkg;
+
+  cur_domain = new domain_t[package_count];
+  new_domain = new domain_t[package_count];
+  memset (cur_domain, DOMAIN_DEFAULT, package_count);
+  memset (new_domain, DOMAIN_UNSIGNED, package_count);
 
   FILE *f = fopen ("/var/lib/hildon-application-manager/autoinst", "r");
   if (f)
@@ -685,7 +934,7 @@ myCacheFile::load_extra_info ()
 	  if (!pkg.end ())
 	    {
 	      DBG ("auto: %s", pkg.Name ());
-	      extra_info[pkg->ID].autoinst = true;
+	      autoinst.set (pkg->ID, true);
 	    }
 	}
 
@@ -715,7 +964,7 @@ myCacheFile::load_extra_info ()
 	      if (!pkg.end ())
 		{
 		  // DBG ("%s: %s (%d)", domains[i].name, pkg.Name (), pkg->ID);
-		  extra_info[pkg->ID].cur_domain = i;
+		  cur_domain[pkg->ID] = i;
 		}
 	    }
 
@@ -862,7 +1111,8 @@ ForceLock (string File, bool Errors = true)
    the mere arrival of a byte triggers the abort.
 
    When using the libapt-pkg PackageManager, it is configured in such
-   a way that it sends it "pmstatus:" message lines to STATUS_FD.
+   a way that it sends it "pmstatus:" message lines to STATUS_FD,
+   together with our own "pmeta:" lines (see TimedProgressFd).
    Other asynchronous status reports are sent as spontaneous
    APTCMD_STATUS responses via OUTPUT_FD.  'Spontaneous' should mean
    that no request is required to receive APTCMD_STATUS responses.  In
@@ -876,6 +1126,14 @@ ForceLock (string File, bool Errors = true)
 
 int input_fd, output_fd, status_fd, cancel_fd;
 
+/* The optional QUERY_IN_FD and QUERY_OUT_FD carry requests and
+   responses just like INPUT_FD and OUTPUT_FD, but only read-only
+   requests are sent over them.  They are used while the main fifos
+   are busy with a long operation; see the READ-ONLY QUERY SERVER
+   section.
+*/
+int query_in_fd = -1, query_out_fd = -1;
+
 /* MUST_READ and MUST_WRITE read and write blocks of raw bytes from
    INPUT_FD and to OUTPUT_FD.  If they return, they have succeeded and
    read or written the whole block.
@@ -981,6 +1239,7 @@ apt_proto_encoder response;
 
 void cmd_get_package_list ();
 void cmd_get_package_info ();
+void cmd_get_package_infos ();
 void cmd_get_package_details ();
 int cmd_check_updates (bool with_status = true);
 void cmd_get_catalogues ();
@@ -1005,6 +1264,7 @@ void cmd_third_party_policy_check ();
 void cmd_autoremove ();
 
 int cmdline_check_updates (char **argv);
+int cmdline_download_updates (char **argv);
 int cmdline_rescue (char **argv);
 
 /** MANAGEMENT FOR FAILED CATALOGUES LOG FILE
@@ -1044,6 +1304,17 @@ static xexp *map_catalogue_error_details (xexp *x);
 
 void cache_init (bool with_status = true);
 
+static void forget_chosen_providers ();
+
+/* Set while the cache has been opened without the dpkg lock.
+ */
+static bool cache_is_unlocked = false;
+
+static void start_dpkg_recovery ();
+static bool dpkg_recovery_running ();
+static bool reap_dpkg_recovery (bool wait);
+void finish_dpkg_recovery (bool with_status);
+
 void
 need_cache_init ()
 {
@@ -1065,6 +1336,7 @@ static const char *cmd_names[] = {
   "RM_TEMP_CATALOGUES",
   "GET_FREE_SPACE",
   "INSTALL_CHECK",
+  "DOWNLOAD_PACKAGE",
   "INSTALL_PACKAGE",
   "REMOVE_CHECK",
   "REMOVE_PACKAGE",
@@ -1077,10 +1349,168 @@ static const char *cmd_names[] = {
   "SET_OPTIONS",
   "SET_ENV",
   "THIRD_PARTY_POLICY_CHECK",
-  "AUTOREMOVE"
+  "AUTOREMOVE",
+  "EXIT",
+  "GET_PACKAGE_INFOS"
 };
 #endif
 
+/** READ-ONLY QUERY SERVER
+
+    While dpkg runs, the worker can't answer any requests, and the UI
+    would not be able to show package details or browse the lists for
+    the whole duration of a long installation.
+
+    Therefore, install_archives forks a query server right before
+    calling dpkg.  Its copy of the cache is a snapshot of the state
+    before the installation and stays unchanged.  It answers the
+    requests that arrive on the query fifos, but only those listed in
+    is_query_command.  When dpkg is done, the server is terminated;
+    SIGTERM is blocked while it handles a request, so that it doesn't
+    die in the middle of a response.
+
+    When no query server is running, the worker itself answers the
+    requests on the query fifos.
+*/
+
+static bool is_query_server = false;
+static pid_t query_server_pid = -1;
+
+void handle_request ();
+
+static bool
+is_query_command (int cmd)
+{
+  return (cmd == APTCMD_NOOP
+	  || cmd == APTCMD_GET_PACKAGE_LIST
+	  || cmd == APTCMD_GET_PACKAGE_DETAILS
+	  || cmd == APTCMD_GET_CATALOGUES);
+}
+
+/* Handle one request from the query fifos.
+ */
+static void
+handle_query_request ()
+{
+  int saved_input_fd = input_fd;
+  int saved_output_fd = output_fd;
+
+  input_fd = query_in_fd;
+  output_fd = query_out_fd;
+  handle_request ();
+  input_fd = saved_input_fd;
+  output_fd = saved_output_fd;
+}
+
+/* Wait for the next request on the main or the query fifos, and
+   handle it.  The main fifos are preferred.
+*/
+static void
+handle_next_request ()
+{
+  if (query_in_fd >= 0)
+    {
+      fd_set set;
+      FD_ZERO (&set);
+      FD_SET (input_fd, &set);
+      FD_SET (query_in_fd, &set);
+
+      if (select (MAX (input_fd, query_in_fd) + 1, &set, NULL, NULL, NULL) < 0)
+	{
+	  if (errno == EINTR)
+	    return;
+	  perror ("apt-worker select");
+	  exit (1);
+	}
+
+      if (!FD_ISSET (input_fd, &set))
+	{
+	  handle_query_request ();
+	  return;
+	}
+    }
+
+  handle_request ();
+}
+
+static void
+start_query_server ()
+{
+  if (query_in_fd < 0 || query_server_pid > 0)
+    return;
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      log_stderr ("fork: %m");
+      return;
+    }
+
+  if (pid > 0)
+    {
+      query_server_pid = pid;
+      return;
+    }
+
+  sigset_t term;
+  sigemptyset (&term);
+  sigaddset (&term, SIGTERM);
+  signal (SIGTERM, SIG_DFL);
+
+  is_query_server = true;
+  input_fd = query_in_fd;
+  output_fd = query_out_fd;
+
+  while (true)
+    {
+      block_for_read (input_fd);
+      sigprocmask (SIG_BLOCK, &term, NULL);
+      handle_request ();
+      sigprocmask (SIG_UNBLOCK, &term, NULL);
+    }
+}
+
+static void
+stop_query_server ()
+{
+  if (query_server_pid <= 0)
+    return;
+
+  if (kill (query_server_pid, SIGTERM) < 0)
+    log_stderr ("kill: %m");
+
+  while (waitpid (query_server_pid, NULL, 0) < 0 && errno == EINTR)
+    ;
+
+  query_server_pid = -1;
+}
+
+/* Whether the command CMD only looks at the cache.
+ */
+static bool
+is_read_only_command (int cmd)
+{
+  switch (cmd)
+    {
+    case APTCMD_NOOP:
+    case APTCMD_GET_PACKAGE_LIST:
+    case APTCMD_GET_PACKAGE_INFO:
+    case APTCMD_GET_PACKAGE_INFOS:
+    case APTCMD_GET_PACKAGE_DETAILS:
+    case APTCMD_GET_CATALOGUES:
+    case APTCMD_GET_FREE_SPACE:
+    case APTCMD_GET_FILE_DETAILS:
+    case APTCMD_GET_SYSTEM_UPDATE_PACKAGES:
+    case APTCMD_SET_OPTIONS:
+    case APTCMD_SET_ENV:
+    case APTCMD_THIRD_PARTY_POLICY_CHECK:
+    case APTCMD_EXIT:
+      return true;
+    default:
+      return false;
+    }
+}
+
 void
 handle_request ()
 {
@@ -1099,7 +1529,10 @@ handle_request ()
   reqbuf = alloc_buf (req.len, stack_reqbuf, FIXED_REQUEST_BUF_SIZE);
   must_read (reqbuf, req.len);
 
-  drain_fd (cancel_fd);
+  /* The cancel fifo belongs to the operation of the main process.
+   */
+  if (!is_query_server)
+    drain_fd (cancel_fd);
 
   request.reset (reqbuf, req.len);
   response.reset ();
@@ -1112,6 +1545,34 @@ handle_request ()
   if (last_modified != domains_last_modified)
     read_domain_conf ();
 
+  /* During a dpkg recovery, only requests that don't change anything
+     are answered from the unlocked cache that we have.  All others
+     wait for the recovery, or run it when a failed installation has
+     left a journal, and get a locked cache.
+  */
+  if (!is_query_server)
+    {
+      if (is_read_only_command (req.cmd))
+	{
+	  if (reap_dpkg_recovery (false))
+	    cache_init (false);
+	}
+      else
+	{
+	  if (!dpkg_recovery_running ())
+	    start_dpkg_recovery ();
+	  finish_dpkg_recovery (true);
+	  if (cache_is_unlocked || awc->cache == NULL)
+	    cache_init (true);
+	}
+    }
+
+  if (is_query_server && !is_query_command (req.cmd))
+    {
+      log_stderr ("not a query: %d", req.cmd);
+      req.cmd = APTCMD_NOOP;
+    }
+
   switch (req.cmd)
     {
 
@@ -1127,6 +1588,10 @@ handle_request ()
       cmd_get_package_info ();
       break;
 
+    case APTCMD_GET_PACKAGE_INFOS:
+      cmd_get_package_infos ();
+      break;
+
     case APTCMD_GET_PACKAGE_DETAILS:
       cmd_get_package_details ();
       break;
@@ -1252,6 +1717,7 @@ static void
 usage ()
 {
   fprintf (stderr, "Usage: apt-worker check-for-updates [http_proxy]\n");
+  fprintf (stderr, "       apt-worker download-updates budget [http_proxy]\n");
   fprintf (stderr, "       apt-worker rescue [package] [archives]\n");
   exit (1);
 }
@@ -1353,7 +1819,16 @@ get_apt_worker_lock (bool weak)
 	      exit (1);
 	    }
 
-	  if (weak || his_type != 'w')
+	  if (weak && his_type == 's')
+	    {
+	      /* A backend is running for the Application Manager.  It
+		 will be busy for a while, and our caller should rather
+		 ask it to do the work.
+	      */
+	      log_stderr ("%d is running, leaving it alone.", his_pid);
+	      exit (APT_WORKER_EXIT_BUSY);
+	    }
+	  else if (weak || his_type != 'w')
 	    {
 	      if (lock_attempts < 5)
 	        {
@@ -1401,8 +1876,10 @@ get_apt_worker_lock (bool weak)
 #define REMOVABLE_MMC_MOUNTPOINT "/media/mmc1"
 #define HOME_MOUNTPOINT  "/home"
 
+/* Everything that is needed before the cache can be opened.
+ */
 static void
-misc_init ()
+misc_init_settings ()
 {
   lc_messages = getenv ("LC_MESSAGES");
   DBG ("LC_MESSAGES %s", lc_messages);
@@ -1413,7 +1890,12 @@ misc_init ()
   read_domain_conf ();
 
   AptWorkerCache::Initialize ();
+}
 
+static void
+misc_init_cache ()
+{
+  start_dpkg_recovery ();
   cache_init (false);
 
 #ifdef HAVE_APT_TRUST_HOOK
@@ -1427,6 +1909,13 @@ misc_init ()
   setenv ("REMOVABLE_MMC_MOUNTPOINT", REMOVABLE_MMC_MOUNTPOINT, 1);
 }
 
+static void
+misc_init ()
+{
+  misc_init_settings ();
+  misc_init_cache ();
+}
+
 void
 set_options (const char *options)
 {
@@ -1441,6 +1930,9 @@ set_options (const char *options)
 
   if (strchr (options, 'A'))
     flag_use_apt_algorithms = true;
+
+  if (strchr (options, 'P'))
+    flag_pipelined_install = true;
 }
 
 void
@@ -1518,7 +2010,7 @@ main (int argc, char **argv)
     {
       const char *options;
 
-      if (argc != 6)
+      if (argc != 6 && argc != 8)
 	{
 	  log_stderr ("wrong invocation");
 	  exit (1);
@@ -1552,6 +2044,23 @@ main (int argc, char **argv)
       g_free (status_pipe);
       g_free (cancel_pipe);
 
+      if (argc == 8)
+	{
+	  char *query_in_pipe = is_fifo (argv[6]);
+	  char *query_out_pipe = is_fifo (argv[7]);
+
+	  if (query_in_pipe && query_out_pipe)
+	    {
+	      query_in_fd = must_open (query_in_pipe, O_RDONLY | O_NONBLOCK);
+	      query_out_fd = must_open (query_out_pipe, O_WRONLY);
+	    }
+	  else
+	    log_stderr ("wrong query fifo pipes specified");
+
+	  g_free (query_in_pipe);
+	  g_free (query_out_pipe);
+	}
+
       /* This tells the frontend that the fifos are open.
        */
       send_status (op_general, 0, 0, -1);
@@ -1566,6 +2075,8 @@ main (int argc, char **argv)
 	 non-blocking mode since we just poll it periodically.
       */
       must_set_flags (input_fd, O_RDONLY);
+      if (query_in_fd >= 0)
+	must_set_flags (query_in_fd, O_RDONLY);
 
       options = argv[5];
 
@@ -1585,16 +2096,29 @@ main (int argc, char **argv)
       misc_init ();
 
       while (true)
-	handle_request ();
+	handle_next_request ();
 
       return 0;
     }
   else if (!strcmp (argv[0], "check-for-updates"))
     {
       get_apt_worker_lock (true);
-      misc_init ();
+      misc_init_settings ();
       return cmdline_check_updates (argv);
     }
+  else if (!strcmp (argv[0], "download-updates"))
+    {
+      /* This runs in the background, so be as nice as the backend.
+       */
+      errno = 0;
+      if (nice (20) == -1 && errno != 0)
+	log_stderr ("nice: %m");
+
+      get_apt_worker_lock (true);
+      misc_init ();
+      finish_dpkg_recovery (false);
+      return cmdline_download_updates (argv);
+    }
   else if (!strcmp (argv[0], "rescue"))
     {
       return cmdline_rescue (argv);
@@ -1753,20 +2277,51 @@ is_user_package (const pkgCache::VerIterator &ver)
    journal.
 */
 
-static void
-clear_dpkg_updates ()
-{
-  string File = flNotFile(_config->Find("Dir::State::status")) + "updates/";
-  DIR *DirP = opendir(File.c_str());
-  if (DirP == 0)
-    return;
-   
-  /* We ignore any files that are not all digits, this skips .,.. and 
-     some tmp files dpkg will leave behind.. */
+/* Recovering from an interrupted dpkg run.
 
-  for (struct dirent *Ent = readdir(DirP); Ent != 0; Ent = readdir(DirP))
-    {
-      bool ignore = false;
+   When dpkg is interrupted, it leaves a journal in "updates/" next to
+   its status file, and "dpkg --configure dpkg" has to be run before
+   anything can be installed or removed.  That can take a long time,
+   so when a journal is found at start up, the recovery is started as
+   a child process and runs in the background; see misc_init_cache.
+
+   While it runs, the cache is opened without taking the dpkg lock,
+   which dpkg needs, and only read-only requests are answered from
+   it.  The first request that wants to change something waits for
+   the recovery to finish and gets a fresh, locked cache.  Such a
+   request also runs the recovery itself when an earlier installation
+   has left a journal behind.  See handle_request.
+*/
+
+static pid_t dpkg_recovery_pid = -1;
+
+/* Set when a recovery failed.  We don't try again in that case, since
+   the requests waiting for it would never be served.
+*/
+static bool dpkg_recovery_failed = false;
+
+static bool
+dpkg_recovery_running ()
+{
+  return dpkg_recovery_pid > 0;
+}
+
+static bool
+dpkg_journal_present ()
+{
+  string File = flNotFile(_config->Find("Dir::State::status")) + "updates/";
+  DIR *DirP = opendir(File.c_str());
+  if (DirP == 0)
+    return false;
+
+  bool present = false;
+
+  /* We ignore any files that are not all digits, this skips .,.. and 
+     some tmp files dpkg will leave behind.. */
+
+  for (struct dirent *Ent = readdir(DirP); Ent != 0; Ent = readdir(DirP))
+    {
+      bool ignore = false;
 
       for (unsigned int I = 0; Ent->d_name[I] != 0; I++)
 	{
@@ -1780,14 +2335,112 @@ clear_dpkg_updates ()
 
       if (!ignore)
 	{
-	  log_stderr ("Running 'dpkg --configure dpkg' "
-		      "to clean up the journal.");
-	  system ("dpkg --configure dpkg");
+	  present = true;
 	  break;
 	}
     }
 
-   closedir(DirP);
+  closedir(DirP);
+  return present;
+}
+
+/* Close the cache, if it is open.  This gives the dpkg lock back.
+ */
+static void
+cache_close ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  if (awc->cache)
+    {
+      DBG ("closing");
+      delete awc->action_group;
+      awc->cache->Close ();
+      delete awc->cache;
+      awc->cache = 0;
+      DBG ("done");
+    }
+}
+
+/* Start the recovery when there is a journal.  The cache is closed
+   first, since dpkg needs the lock that it might hold.
+*/
+static void
+start_dpkg_recovery ()
+{
+  if (dpkg_recovery_pid > 0 || dpkg_recovery_failed
+      || !dpkg_journal_present ())
+    return;
+
+  cache_close ();
+
+  log_stderr ("Running 'dpkg --configure dpkg' "
+	      "to clean up the journal.");
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      log_stderr ("fork: %m");
+      system ("dpkg --configure dpkg");
+    }
+  else if (pid == 0)
+    {
+      /* Don't leak our fifos and lock files into dpkg.
+       */
+      for (int fd = sysconf (_SC_OPEN_MAX) - 1; fd > 2; fd--)
+	close (fd);
+
+      execlp ("dpkg", "dpkg", "--configure", "dpkg", NULL);
+      _exit (127);
+    }
+  else
+    dpkg_recovery_pid = pid;
+}
+
+/* Check whether the recovery has finished, waiting for it when WAIT
+   is true.  Return true if a recovery was running and is finished
+   now.
+*/
+static bool
+reap_dpkg_recovery (bool wait)
+{
+  if (dpkg_recovery_pid <= 0)
+    return false;
+
+  int status;
+  pid_t r;
+  do
+    r = waitpid (dpkg_recovery_pid, &status, wait? 0 : WNOHANG);
+  while (r < 0 && errno == EINTR);
+
+  if (r == 0)
+    return false;
+
+  if (r < 0)
+    log_stderr ("waitpid: %m");
+  else if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      log_stderr ("dpkg --configure dpkg failed: %d", status);
+      dpkg_recovery_failed = true;
+    }
+
+  dpkg_recovery_pid = -1;
+  return true;
+}
+
+/* Wait for a running recovery and reopen the cache afterwards.
+ */
+void
+finish_dpkg_recovery (bool with_status)
+{
+  if (dpkg_recovery_pid <= 0)
+    return;
+
+  if (with_status)
+    send_status (op_general, -1, 1, 0);
+
+  reap_dpkg_recovery (true);
+  cache_init (with_status);
 }
 
 void cache_reset ();
@@ -1827,30 +2480,22 @@ cache_init (bool with_status)
    * does not remove the dpkg state lock and then fails on trying to
    * run dpkg */
   /* @todo do we really keep doing this? */
-  if (awc->cache)
-    {
-      DBG ("closing");
-      delete awc->action_group;
-      awc->cache->Close ();
-      delete awc->cache;
-      awc->cache = 0;
-      DBG ("done");
-    }
+  cache_close ();
 
   /* We need to dump the errors here since any pending errors will
      cause the following operations to fail.
   */
   _error->DumpErrors ();
 
-  /* Clear out the dpkg journal before construction the cache.
-   */
-  clear_dpkg_updates ();
-
   UpdateProgress progress (with_status);
   awc->cache = new myCacheFile;
 
+  /* Don't take the dpkg lock away from a running recovery.
+   */
+  bool with_lock = !dpkg_recovery_running ();
+
   DBG ("init.");
-  if (!awc->cache->Open (progress))
+  if (!awc->cache->Open (progress, with_lock))
     {
       DBG ("failed.");
       _error->DumpErrors ();
@@ -1858,6 +2503,8 @@ cache_init (bool with_status)
       awc->cache = 0;
     }
 
+  cache_is_unlocked = (awc->cache && !with_lock);
+
   if (awc->cache)
     {
       /* We create a ActionGroup here that is active for the whole
@@ -1871,6 +2518,12 @@ cache_init (bool with_status)
 
   cache_reset ();
 
+  /* Remember the freshly reset state so that later calls to
+     cache_reset can simply copy it back.
+  */
+  if (awc->cache)
+    awc->cache->dep_cache ()->save_state ();
+
   if (awc->cache)
     write_available_updates_file ();
 }
@@ -1905,7 +2558,7 @@ bool
 is_related (pkgCache::PkgIterator &pkg)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  return awc->cache->extra_info[pkg->ID].related;
+  return awc->cache->related.contains (pkg->ID);
 }
 
 void
@@ -1914,15 +2567,15 @@ mark_related (const pkgCache::VerIterator &ver)
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   const pkgCache::PkgIterator &pkg = ver.ParentPkg();
 
-  if (awc->cache->extra_info[pkg->ID].related)
+  if (awc->cache->related.contains (pkg->ID))
     return;
 
-  awc->cache->extra_info[pkg->ID].related = true;
+  awc->cache->related.set (pkg->ID, true);
 
-  pkgDepCache &cache = *awc->cache;
+  myDepCache &cache = *awc->cache->dep_cache ();
 
   if (pkg.State() == pkgCache::PkgIterator::NeedsUnpack)
-    cache.SetReInstall (pkg, true);
+    cache.set_reinstall (pkg, true);
 
   /* When there are some packages that might need configuring or
      unpacking, we also mark all dependencies of this package as
@@ -1941,6 +2594,81 @@ mark_related (const pkgCache::VerIterator &ver)
     }
 }
 
+/* Sets of the packages that are broken, upgraded, or deleted in the
+   'desired' state of the cache.
+
+   They are collected in a single pass the first time that they are
+   needed after the desired state has changed, and without any pass
+   at all when the counters of libapt-pkg say that they are empty.
+   The summaries of a simulation then only look at these few
+   packages.  Whether the desired state has changed is tracked by the
+   marking wrappers of myDepCache.  Debug builds check on every use
+   that the sets are still accurate, which catches marking that
+   bypasses those wrappers.
+*/
+
+static package_set broken_packages;
+static package_set upgraded_packages;
+static package_set deleted_packages;
+
+static void
+collect_package_sets (myDepCache &cache,
+		      package_set &broken,
+		      package_set &upgraded,
+		      package_set &deleted)
+{
+  broken.init (cache.Head().PackageCount);
+  upgraded.init (cache.Head().PackageCount);
+  deleted.init (cache.Head().PackageCount);
+
+  if (cache.BrokenCount () > 0
+      || cache.InstCount () > 0
+      || cache.DelCount () > 0)
+    {
+      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+	{
+	  pkgDepCache::StateCache &state = cache[pkg];
+
+	  if (state.InstBroken ())
+	    broken.set (pkg->ID, true);
+	  if (state.Upgrade ())
+	    upgraded.set (pkg->ID, true);
+	  if (state.Delete ())
+	    deleted.set (pkg->ID, true);
+	}
+    }
+}
+
+static void
+update_package_sets ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  myDepCache &cache = *awc->cache->dep_cache ();
+
+  if (!cache.changed ())
+    {
+#ifdef DEBUG
+      package_set broken, upgraded, deleted;
+      collect_package_sets (cache, broken, upgraded, deleted);
+      assert (broken == broken_packages
+	      && upgraded == upgraded_packages
+	      && deleted == deleted_packages);
+#endif
+      return;
+    }
+
+  collect_package_sets (cache,
+			broken_packages, upgraded_packages, deleted_packages);
+  cache.forget_changes ();
+}
+
+static pkgCache::PkgIterator
+package_by_id (int id)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  return awc->cache->package_by_id (id);
+}
+
 /* Revert the cache to its initial state.  More concretely, all
    packages are marked as 'keep' and 'unrelated'.
 
@@ -1950,17 +2678,17 @@ void
 cache_reset_package (pkgCache::PkgIterator &pkg)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  pkgDepCache &cache = *(awc->cache);
+  myDepCache &cache = *awc->cache->dep_cache ();
 
-  cache.MarkKeep (pkg);
+  cache.mark_keep (pkg);
 
-  if (awc->cache->extra_info[pkg->ID].autoinst)
+  if (awc->cache->autoinst.contains (pkg->ID))
     cache[pkg].Flags |= pkgCache::Flag::Auto;
   else
     cache[pkg].Flags &= ~pkgCache::Flag::Auto;
   
-  awc->cache->extra_info[pkg->ID].related = false;
-  awc->cache->extra_info[pkg->ID].soft = false;
+  awc->cache->related.set (pkg->ID, false);
+  awc->cache->soft.set (pkg->ID, false);
 }
 
 static bool
@@ -1971,10 +2699,14 @@ any_newly_or_related_broken ()
     return false;
 
   pkgDepCache &cache = *(awc->cache);
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+
+  update_package_sets ();
+  for (int id = broken_packages.next (0);
+       id >= 0;
+       id = broken_packages.next (id + 1))
     {
-      if (cache[pkg].InstBroken() &&
-	  (!cache[pkg].NowBroken() || is_related (pkg)))
+      pkgCache::PkgIterator pkg = package_by_id (id);
+      if (!cache[pkg].NowBroken() || is_related (pkg))
 	return true;
     }
   return false;
@@ -1984,13 +2716,23 @@ void
 cache_reset ()
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  forget_chosen_providers ();
   if (awc->cache == NULL)
     return;
 
   pkgDepCache &cache = *(awc->cache);
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
-    cache_reset_package (pkg);
+  if (awc->cache->dep_cache ()->restore_state ())
+    {
+      awc->cache->related.clear ();
+      awc->cache->soft.clear ();
+    }
+  else
+    {
+      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+	cache_reset_package (pkg);
+    }
 
   g_free (current_cache_package);
   current_cache_package = NULL;
@@ -2003,9 +2745,50 @@ cache_reset ()
 
    For each package that is broken for the planned operation, we try
    to fix it by undoing the removal of softly removed packages that it
-   depends on.  We do this in a loop since a package that has been put
-   back might be broken itself and be in need of fixing.
+   depends on.  A package that has been put back might be broken
+   itself, and it might break the packages that conflict with it, so
+   it and the packages that depend on it or on what it provides are
+   put on the worklist as well.  A package that got something put
+   back is looked at again, since it might need more.
 */
+
+static void
+fix_soft_packages_enqueue (pkgCache::PkgIterator pkg,
+			   std::vector<int> &worklist, package_set &queued)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+
+  if (!queued.contains (pkg->ID) && cache[pkg].InstBroken())
+    {
+      queued.set (pkg->ID, true);
+      worklist.push_back (pkg->ID);
+    }
+}
+
+static void
+fix_soft_packages_enqueue_rdepends (pkgCache::PkgIterator &pkg,
+				    std::vector<int> &worklist,
+				    package_set &queued)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+
+  fix_soft_packages_enqueue (pkg, worklist, queued);
+
+  for (pkgCache::DepIterator D = pkg.RevDependsList(); !D.end(); D++)
+    fix_soft_packages_enqueue (D.ParentPkg(), worklist, queued);
+
+  pkgCache::VerIterator ver = cache[pkg].InstVerIter(cache);
+  if (ver.end())
+    return;
+
+  for (pkgCache::PrvIterator P = ver.ProvidesList(); !P.end(); P++)
+    for (pkgCache::DepIterator D = P.ParentPkg().RevDependsList();
+	 !D.end(); D++)
+      fix_soft_packages_enqueue (D.ParentPkg(), worklist, queued);
+}
+
 void
 fix_soft_packages ()
 {
@@ -2015,68 +2798,87 @@ fix_soft_packages ()
 
   pkgDepCache &cache = *(awc->cache);
 
-  bool something_changed;
+  DBG ("FIX");
+
+  std::vector<int> worklist;
+  package_set queued;
+  queued.init (cache.Head().PackageCount);
+
+  update_package_sets ();
+  for (int id = broken_packages.next (0);
+       id >= 0;
+       id = broken_packages.next (id + 1))
+    {
+      queued.set (id, true);
+      worklist.push_back (id);
+    }
 
-  do 
+  while (!worklist.empty ())
     {
-      DBG ("FIX");
+      int id = worklist.back ();
+      worklist.pop_back ();
+      queued.set (id, false);
 
-      something_changed = false;
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+      pkgCache::PkgIterator pkg = package_by_id (id);
+
+      if (!cache[pkg].InstBroken())
+	continue;
+
+      bool something_changed = false;
+
+      pkgCache::DepIterator Dep =
+	cache[pkg].InstVerIter(cache).DependsList();
+      for (; Dep.end() != true;)
 	{
-	  if (cache[pkg].InstBroken())
+	  // Grok or groups
+	  pkgCache::DepIterator Start = Dep;
+	  bool Result = true;
+	  for (bool LastOR = true;
+	       Dep.end() == false && LastOR == true;
+	       Dep++)
 	    {
-	      pkgCache::DepIterator Dep =
-		cache[pkg].InstVerIter(cache).DependsList();
-	      for (; Dep.end() != true;)
-		{
-		  // Grok or groups
-		  pkgCache::DepIterator Start = Dep;
-		  bool Result = true;
-		  for (bool LastOR = true;
-		       Dep.end() == false && LastOR == true;
-		       Dep++)
-		    {
-		      LastOR = ((Dep->CompareOp & pkgCache::Dep::Or)
-				== pkgCache::Dep::Or);
-		    
-		      if ((cache[Dep] & pkgDepCache::DepInstall)
-			  == pkgDepCache::DepInstall)
-			Result = false;
-		    }
-		
-		  // Dep is satisfied okay.
-		  if (Result == false)
-		    continue;
+	      LastOR = ((Dep->CompareOp & pkgCache::Dep::Or)
+			== pkgCache::Dep::Or);
+
+	      if ((cache[Dep] & pkgDepCache::DepInstall)
+		  == pkgDepCache::DepInstall)
+		Result = false;
+	    }
 
-		  // Try to fix it by putting back the first softly
-		  // removed target
+	  // Dep is satisfied okay.
+	  if (Result == false)
+	    continue;
 
-		  for (bool LastOR = true;
-		       Start.end() == false && LastOR == true;
-		       Start++)
-		    {
-		      LastOR = ((Start->CompareOp & pkgCache::Dep::Or)
-				== pkgCache::Dep::Or);
-		    
-		      pkgCache::PkgIterator Pkg = Start.TargetPkg ();
-
-		      if (((cache[Start] & pkgDepCache::DepInstall)
-			   != pkgDepCache::DepInstall)
-			  && !Pkg.end()
-			  && cache[Pkg].Delete()
-              && awc->cache->extra_info[Pkg->ID].soft)
-			{
-			  DBG ("= %s", Pkg.Name());
-			  cache_reset_package (Pkg);
-			  something_changed = true;
-			  break;
-			}
-		    }
+	  // Try to fix it by putting back the first softly
+	  // removed target
+
+	  for (bool LastOR = true;
+	       Start.end() == false && LastOR == true;
+	       Start++)
+	    {
+	      LastOR = ((Start->CompareOp & pkgCache::Dep::Or)
+			== pkgCache::Dep::Or);
+
+	      pkgCache::PkgIterator Pkg = Start.TargetPkg ();
+
+	      if (((cache[Start] & pkgDepCache::DepInstall)
+		   != pkgDepCache::DepInstall)
+		  && !Pkg.end()
+		  && cache[Pkg].Delete()
+		  && awc->cache->soft.contains (Pkg->ID))
+		{
+		  DBG ("= %s", Pkg.Name());
+		  cache_reset_package (Pkg);
+		  fix_soft_packages_enqueue_rdepends (Pkg, worklist, queued);
+		  something_changed = true;
+		  break;
 		}
 	    }
 	}
-    } while (something_changed);
+
+      if (something_changed)
+	fix_soft_packages_enqueue (pkg, worklist, queued);
+    }
 }
 
 /* Determine whether PKG replaces TARGET.
@@ -2147,48 +2949,166 @@ package_is_needed (pkgCache::PkgIterator &pkg)
 
 static void mark_for_remove_1 (pkgCache::PkgIterator &pkg, bool soft);
 
+/* The package that has been chosen to satisfy a dependency, indexed
+   by the ID of the dependency.  A simulation often looks at the same
+   dependency many times, and this saves calling AllTargets and
+   pkgPrioSortList again for each of them.  The stored value is the
+   pkgCache::Package, or NULL when there is no suitable package.
+
+   The choice depends on the candidate versions, which are only
+   fixed for one simulation, so the table is emptied by
+   CACHE_RESET.
+*/
+static GHashTable *chosen_providers = NULL;
+
 static void
-mark_for_install_1 (pkgCache::PkgIterator &pkg, int level)
+forget_chosen_providers ()
+{
+  if (chosen_providers)
+    g_hash_table_remove_all (chosen_providers);
+}
+
+static pkgCache::PkgIterator
+choose_provider (pkgCache::DepIterator &Start)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
+  pkgCache &pkgcache = cache.GetCache ();
 
-  /* This check is just to be extra robust against infinite
-     recursions.  They shouldn't happen, but you never know...
-  */
-  if (level > 100)
-    return;
+  if (chosen_providers == NULL)
+    chosen_providers = g_hash_table_new (NULL, NULL);
+
+  gpointer key = GINT_TO_POINTER (Start->ID);
+  gpointer chosen;
+  if (g_hash_table_lookup_extended (chosen_providers, key, NULL, &chosen))
+    {
+      if (chosen)
+	return pkgCache::PkgIterator (pkgcache, (pkgCache::Package *)chosen);
+      else
+	return pkgCache::PkgIterator (cache, 0);
+    }
+
+  std::unique_ptr<pkgCache::Version *[]> List (Start.AllTargets());
+
+  // Right, find the best version to install..
+  pkgCache::Version **Cur = List.get();
+  pkgCache::PkgIterator P = Start.TargetPkg();
+  pkgCache::PkgIterator InstPkg(cache,0);
+
+  // See if there are direct matches (at the start of the list)
+  for (; *Cur != 0 && (*Cur)->ParentPkg == P.MapPointer(); Cur++)
+    {
+      pkgCache::PkgIterator Pkg(pkgcache,
+				pkgcache.PkgP + (*Cur)->ParentPkg);
+      if (cache[Pkg].CandidateVer != *Cur)
+	continue;
+      InstPkg = Pkg;
+      break;
+    }
+
+  // Select the highest priority providing package
+  if (InstPkg.end() == true)
+    {
+      pkgPrioSortList(cache,Cur);
+      for (; *Cur != 0; Cur++)
+	{
+	  pkgCache::PkgIterator
+	    Pkg(pkgcache,pkgcache.PkgP + (*Cur)->ParentPkg);
+	  if (cache[Pkg].CandidateVer != *Cur)
+	    continue;
+	  InstPkg = Pkg;
+	  break;
+	}
+    }
+
+  g_hash_table_insert (chosen_providers, key,
+		       InstPkg.end() ? NULL : (pkgCache::Package *)InstPkg);
+  return InstPkg;
+}
+
+/* Mark PKG itself for installation.  Returns true when its
+   dependencies need to be looked at.
+*/
+static bool
+mark_for_install_start (pkgCache::PkgIterator &pkg)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  myDepCache &cache = *awc->cache->dep_cache ();
 
   mark_related (cache[pkg].CandidateVerIter(cache));
 
-  /* Avoid recursion if package is already marked for installation but
-     try to fix it when it is broken.
+  /* Don't look at the dependencies again if package is already
+     marked for installation but try to fix it when it is broken.
    */
   if (cache[pkg].Mode == pkgDepCache::ModeInstall
       && !cache[pkg].InstBroken ())
-    return;
+    return false;
 
   DBG ("+ %s", pkg.Name());
 
   /* Now mark it and return if that fails.  Both ModeInstall and
      ModeKeep are fine.  ModeKeep only happens for broken packages.
    */
-  cache.MarkInstall (pkg, false);
+  cache.mark_install (pkg, false);
   if (cache[pkg].Mode != pkgDepCache::ModeInstall
       && cache[pkg].Mode != pkgDepCache::ModeKeep)
-    return;
+    return false;
+
+  return true;
+}
+
+/* A package whose dependencies are being satisfied.  DEP is the next
+   dependency to look at, and SET_AUTO says whether the package
+   should get the Auto flag when all of them are done.
+*/
+struct install_frame {
+  pkgCache::PkgIterator pkg;
+  pkgCache::DepIterator dep;
+  bool set_auto;
+};
 
-  /* Try to satisfy dependencies.  We can't use MarkInstall with
-     AutoInst == true since we don't like how it handles conflicts,
-     and we have our own way of uninstalling packages.
+static void
+mark_for_install_1 (pkgCache::PkgIterator &pkg, int level)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
 
-     The code below is lifted from pkgDepCache::MarkInstall.  Sorry
-     for introducing this mess here.
+  /* The dependencies are followed depth-first with an explicit stack
+     instead of recursion.  The depth check is just to be extra
+     robust against infinite loops.  They shouldn't happen, but you
+     never know...
   */
+  if (level > 100 || !mark_for_install_start (pkg))
+    return;
 
-  pkgCache::DepIterator Dep = cache[pkg].InstVerIter(cache).DependsList();
-  for (; Dep.end() != true;)
+  std::vector<install_frame> stack;
+  install_frame root = { pkg, cache[pkg].InstVerIter(cache).DependsList(),
+			 false };
+  stack.push_back (root);
+
+  while (!stack.empty ())
     {
+      pkgCache::PkgIterator cur = stack.back().pkg;
+      pkgCache::DepIterator Dep = stack.back().dep;
+
+      if (Dep.end ())
+	{
+	  // Set the autoflag, after MarkInstall because
+	  // MarkInstall unsets it
+	  if (stack.back().set_auto)
+	    cache[cur].Flags |= pkgCache::Flag::Auto;
+	  stack.pop_back ();
+	  continue;
+	}
+
+      /* Try to satisfy dependencies.  We can't use MarkInstall with
+	 AutoInst == true since we don't like how it handles conflicts,
+	 and we have our own way of uninstalling packages.
+
+	 The code below is lifted from pkgDepCache::MarkInstall.  Sorry
+	 for introducing this mess here.
+      */
+
       // Grok or groups
       pkgCache::DepIterator Start = Dep;
       bool Result = true;
@@ -2201,7 +3121,8 @@ mark_for_install_1 (pkgCache::PkgIterator &pkg, int level)
 	  if ((cache[Dep] & pkgDepCache::DepInstall) == pkgDepCache::DepInstall)
 	    Result = false;
 	}
-      
+      stack.back().dep = Dep;
+
       // Dep is satisfied okay.
       if (Result == false)
 	continue;
@@ -2212,7 +3133,7 @@ mark_for_install_1 (pkgCache::PkgIterator &pkg, int level)
       if (cache.IsImportantDep(Start) == false)
 	continue;
 
-      if (pkg->CurrentVer != 0 && Start.IsCritical() == false)
+      if (cur->CurrentVer != 0 && Start.IsCritical() == false)
 	continue;
       
       /* If we are in an or group locate the first or that can 
@@ -2224,52 +3145,25 @@ mark_for_install_1 (pkgCache::PkgIterator &pkg, int level)
 
       /* This bit is for processing the possibilty of an install/upgrade
          fixing the problem */
-      //SPtrArray<pkgCache::Version *> List = Start.AllTargets();
-      std::unique_ptr<pkgCache::Version *> List;
-      List.reset(Start.AllTargets());
       if ((cache[Start] & pkgDepCache::DepCVer) == pkgDepCache::DepCVer)
 	{
-	  // Right, find the best version to install..
-	  pkgCache::Version **Cur = List.get();
 	  pkgCache::PkgIterator P = Start.TargetPkg();
-	  pkgCache::PkgIterator InstPkg(cache,0);
+	  pkgCache::PkgIterator InstPkg = choose_provider (Start);
 
-	  // See if there are direct matches (at the start of the list)
-	  for (; *Cur != 0 && (*Cur)->ParentPkg == P.MapPointer(); Cur++)
+	  if (InstPkg.end() == false)
 	    {
-	      pkgCache &pkgcache = cache.GetCache ();
-	      pkgCache::PkgIterator Pkg(pkgcache,
-					pkgcache.PkgP + (*Cur)->ParentPkg);
-	      if (cache[Pkg].CandidateVer != *Cur)
-		continue;
-	      InstPkg = Pkg;
-	      break;
-	    }
+	      bool set_auto = (P->CurrentVer == 0);
 
-	  // Select the highest priority providing package
-	  if (InstPkg.end() == true)
-	    {
-	      pkgPrioSortList(cache,Cur);
-	      for (; *Cur != 0; Cur++)
+	      if (level + (int) stack.size () <= 100
+		  && mark_for_install_start (InstPkg))
 		{
-		  pkgCache &pkgcache = cache.GetCache ();
-		  pkgCache::PkgIterator
-		    Pkg(pkgcache,pkgcache.PkgP + (*Cur)->ParentPkg);
-		  if (cache[Pkg].CandidateVer != *Cur)
-		    continue;
-		  InstPkg = Pkg;
-		  break;
+		  install_frame next =
+		    { InstPkg, cache[InstPkg].InstVerIter(cache).DependsList(),
+		      set_auto };
+		  stack.push_back (next);
 		}
-	    }
-	  
-	  if (InstPkg.end() == false)
-	    {
-	      mark_for_install_1 (InstPkg, level + 1);
-
-	      // Set the autoflag, after MarkInstall because
-	      // MarkInstall unsets it
-	      if (P->CurrentVer == 0)
-		cache[InstPkg].Flags |= pkgCache::Flag::Auto;
+	      else if (set_auto)
+		cache[InstPkg].Flags |= pkgCache::Flag::Auto;
 	    }
 
 	  continue;
@@ -2282,13 +3176,14 @@ mark_for_install_1 (pkgCache::PkgIterator &pkg, int level)
       if (Start->Type == pkgCache::Dep::Conflicts
 	  || Start->Type == pkgCache::Dep::Obsoletes)
 	{
+	  std::unique_ptr<pkgCache::Version *[]> List (Start.AllTargets());
 	  for (pkgCache::Version **I = List.get(); *I != 0; I++)
 	    {
 	      pkgCache::VerIterator Ver(cache,*I);
 	      pkgCache::PkgIterator target = Ver.ParentPkg();
 
 	      if (!is_user_package (Ver)
-		  && package_replaces (pkg, target))
+		  && package_replaces (cur, target))
 		mark_for_remove_1 (target, true);
 	    }
 	  continue;
@@ -2304,7 +3199,7 @@ mark_for_install (pkgCache::PkgIterator &pkg)
   if (flag_use_apt_algorithms)
     {
       AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-      pkgDepCache &Cache = *(awc->cache);
+      myDepCache &Cache = *awc->cache->dep_cache ();
       pkgDepCache::StateCache &State = Cache[pkg];
 
       pkgProblemResolver Fix(&Cache);
@@ -2312,19 +3207,19 @@ mark_for_install (pkgCache::PkgIterator &pkg)
       Fix.Clear(pkg);
       Fix.Protect(pkg);   
 
-      Cache.MarkInstall(pkg,false);
+      Cache.mark_install(pkg,false);
       if (State.Install() == false)
 	{
 	  if (pkg->CurrentVer && pkg.CurrentVer().Downloadable())
-	    Cache.SetReInstall(pkg,true);
+	    Cache.set_reinstall(pkg,true);
 	} 
 
       // Install it with autoinstalling enabled (if we not respect the minial
       // required deps or the policy)
       if (State.InstBroken() == true || State.InstPolicyBroken() == true)
-	Cache.MarkInstall(pkg,true);
+	Cache.mark_install(pkg,true);
 
-      if (Fix.Resolve(true) == false)
+      if (Cache.resolve(Fix) == false)
 	 _error->Discard();
     }
   else
@@ -2391,16 +3286,16 @@ static void
 mark_for_remove_1 (pkgCache::PkgIterator &pkg, bool soft)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  pkgDepCache &cache = *(awc->cache);
+  myDepCache &cache = *awc->cache->dep_cache ();
 
   if (cache[pkg].Delete ())
     return;
 
   DBG ("- %s%s", pkg.Name(), soft? " (soft)" : "");
 
-  cache.MarkDelete (pkg);
+  cache.mark_delete (pkg);
   cache[pkg].Flags &= ~pkgCache::Flag::Auto;
-  awc->cache->extra_info[pkg->ID].soft = soft;
+  awc->cache->soft.set (pkg->ID, soft);
 
   if (!cache[pkg].Delete ())
     return;
@@ -2439,7 +3334,7 @@ mark_for_remove (pkgCache::PkgIterator &pkg)
   if (flag_use_apt_algorithms)
     {
       AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-      pkgDepCache &Cache = *(awc->cache);
+      myDepCache &Cache = *awc->cache->dep_cache ();
 
       pkgProblemResolver Fix(&Cache);
 
@@ -2447,9 +3342,9 @@ mark_for_remove (pkgCache::PkgIterator &pkg)
       Fix.Protect(pkg);   
 
       Fix.Remove(pkg);
-      Cache.MarkDelete (pkg,false);
+      Cache.mark_delete (pkg,false);
 
-      if (Fix.Resolve(true) == false)
+      if (Cache.resolve(Fix) == false)
 	 _error->Discard();
     }
   else
@@ -3064,28 +3959,28 @@ installable_status ()
   pkgDepCache &cache = *(awc->cache);
   int installable_status = status_unable;
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-       pkg.end() != true;
-       pkg++)
+  update_package_sets ();
+  for (int id = broken_packages.next (0);
+       id >= 0;
+       id = broken_packages.next (id + 1))
     {
+      pkgCache::PkgIterator pkg = package_by_id (id);
+
       /* If a non-related package gets newly broken, we report this as
 	 a conflict.  If a related package is broken, we take a closer
 	 look.
       */
-      if (cache[pkg].InstBroken())
+      if (is_related (pkg))
 	{
-	  if (is_related (pkg))
-	    {
-	      installable_status =
-		combine_status (installable_status_1 (pkg),
-				installable_status);
-	    }
-	  else if (!cache[pkg].NowBroken())
-	    {
-	      installable_status =
-		combine_status (status_conflicting,
-				installable_status);
-	    }
+	  installable_status =
+	    combine_status (installable_status_1 (pkg),
+			    installable_status);
+	}
+      else if (!cache[pkg].NowBroken())
+	{
+	  installable_status =
+	    combine_status (status_conflicting,
+			    installable_status);
 	}
     }
 
@@ -3097,25 +3992,17 @@ removable_status ()
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-       pkg.end() != true;
-       pkg++)
-    {
-      if (cache[pkg].InstBroken())
-	return status_needed;
-    }
+
+  if (cache.BrokenCount () > 0)
+    return status_needed;
 
   return status_unable;
 }
 
-void
-cmd_get_package_info ()
+static void
+get_package_info (const char *package, bool only_installable_info,
+		  apt_proto_package_info &info)
 {
-  const char *package = request.decode_string_in_place ();
-  bool only_installable_info = request.decode_int ();
-
-  apt_proto_package_info info;
-
   info.installable_status = status_unknown;
   info.download_size = 0;
   info.install_user_size_delta = 0;
@@ -3141,13 +4028,12 @@ cmd_get_package_info ()
       info.download_size = (int64_t) cache.DebSize ();
       info.install_user_size_delta = (int64_t) cache.UsrSize ();
 
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-	   pkg.end() != true;
-	   pkg++)
+      myCacheFile *c = awc->cache;
+      for (int id = c->related.next (0); id >= 0; id = c->related.next (id + 1))
 	{
-	  if (is_related (pkg)
-	      && (cache[pkg].Upgrade()
-		  || pkg.State() != pkgCache::PkgIterator::NeedsNothing))
+	  pkgCache::PkgIterator pkg = package_by_id (id);
+	  if (cache[pkg].Upgrade()
+	      || pkg.State() != pkgCache::PkgIterator::NeedsNothing)
 	    {
 	      pkgCache::VerIterator ver = cache[pkg].CandidateVerIter(cache);
 
@@ -3170,22 +4056,21 @@ cmd_get_package_info ()
 	      if (!pkg.end())
 		mark_for_remove (pkg);
 
-	      for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-		   pkg.end() != true;
-		   pkg++)
+	      update_package_sets ();
+	      for (int id = deleted_packages.next (0);
+		   id >= 0;
+		   id = deleted_packages.next (id + 1))
 		{
-		  if (cache[pkg].Delete())
+		  pkgCache::PkgIterator pkg = package_by_id (id);
+		  pkgCache::VerIterator ver = pkg.CurrentVer ();
+
+		  rec.lookup(ver);
+		  int flags = get_flags (rec);
+		  if (flags & pkgflag_system_update)
 		    {
-		      pkgCache::VerIterator ver = pkg.CurrentVer ();
-
-		      rec.lookup(ver);
-		      int flags = get_flags (rec);
-		      if (flags & pkgflag_system_update)
-			{
-			  info.removable_status =
-			    status_system_update_unremovable;
-			  break;
-			}
+		      info.removable_status =
+			status_system_update_unremovable;
+		      break;
 		    }
 		}
 
@@ -3200,10 +4085,209 @@ cmd_get_package_info ()
 	    }
 	}
     }
+}
+
+void
+cmd_get_package_info ()
+{
+  const char *package = request.decode_string_in_place ();
+  bool only_installable_info = request.decode_int ();
+
+  apt_proto_package_info info;
+  get_package_info (package, only_installable_info, info);
 
   response.encode_mem (&info, sizeof (apt_proto_package_info));
 }
 
+/* APTCMD_GET_PACKAGE_INFOS
+
+   This is GET_PACKAGE_INFO for a batch of packages.  The simulations
+   are independent of each other, so when there are several
+   processors, the batch is spread over helper processes.  Each of
+   them works on its own copy-on-write copy of the cache.  They all
+   take the index of the next package to do from a shared pipe, so a
+   process that is done early simply takes more packages, and they
+   write their results back through a second pipe.  The worker itself
+   takes part in the work as well and finally sends all results in
+   request order.
+*/
+
+#define MAX_PACKAGE_INFO_PROCESSES 4
+#define MIN_PACKAGES_PER_PROCESS   8
+
+/* The indices are all written into the pipe before any work starts,
+   so a batch must fit into it.
+*/
+#define MAX_PARALLEL_PACKAGE_INFOS (PIPE_BUF / sizeof (int))
+
+struct package_info_result {
+  int index;
+  apt_proto_package_info info;
+};
+
+static int
+package_info_processes (int n_packages)
+{
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+  if (n_packages > (int) MAX_PARALLEL_PACKAGE_INFOS)
+    return 1;
+
+  n = MIN (n, MAX_PACKAGE_INFO_PROCESSES);
+  n = MIN (n, n_packages / MIN_PACKAGES_PER_PROCESS);
+  return MAX (n, 1);
+}
+
+static bool
+next_package_info_index (int fd, int *index)
+{
+  int r;
+
+  while ((r = read (fd, index, sizeof (int))) < 0 && errno == EINTR)
+    ;
+  return r == sizeof (int);
+}
+
+/* Compute the infos for all packages whose index can be read from
+   WORK_FD.  When RESULT_FD is not negative, the results are written
+   to it, otherwise they are stored in INFOS.
+*/
+static void
+get_package_infos_from_pipe (int work_fd, int result_fd,
+			     const char **packages,
+			     bool only_installable_info,
+			     apt_proto_package_info *infos, bool *done)
+{
+  int index;
+
+  while (next_package_info_index (work_fd, &index))
+    {
+      if (result_fd < 0)
+	{
+	  get_package_info (packages[index], only_installable_info,
+			    infos[index]);
+	  done[index] = true;
+	}
+      else
+	{
+	  package_info_result res;
+	  res.index = index;
+	  get_package_info (packages[index], only_installable_info,
+			    res.info);
+
+	  /* Writes of at most PIPE_BUF bytes are atomic.
+	   */
+	  if (write (result_fd, &res, sizeof (res)) != sizeof (res))
+	    _exit (1);
+	}
+    }
+}
+
+static void
+get_package_infos_parallel (int n_procs, const char **packages, int n,
+			    bool only_installable_info,
+			    apt_proto_package_info *infos, bool *done)
+{
+  int work[2], results[2];
+
+  if (pipe (work) < 0)
+    {
+      log_stderr ("pipe: %m");
+      return;
+    }
+
+  if (pipe (results) < 0)
+    {
+      log_stderr ("pipe: %m");
+      close (work[0]);
+      close (work[1]);
+      return;
+    }
+
+  for (int i = 0; i < n; i++)
+    if (write (work[1], &i, sizeof (int)) != sizeof (int))
+      log_stderr ("write: %m");
+  close (work[1]);
+
+  GSList *children = NULL;
+  for (int p = 1; p < n_procs; p++)
+    {
+      pid_t pid = fork ();
+      if (pid < 0)
+	{
+	  log_stderr ("fork: %m");
+	  break;
+	}
+      if (pid == 0)
+	{
+	  close (results[0]);
+	  get_package_infos_from_pipe (work[0], results[1], packages,
+				       only_installable_info, NULL, NULL);
+	  _exit (0);
+	}
+      children = g_slist_prepend (children, GINT_TO_POINTER (pid));
+    }
+  close (results[1]);
+
+  get_package_infos_from_pipe (work[0], -1, packages,
+			       only_installable_info, infos, done);
+  close (work[0]);
+
+  package_info_result res;
+  while (read (results[0], &res, sizeof (res)) == sizeof (res))
+    {
+      if (res.index >= 0 && res.index < n)
+	{
+	  infos[res.index] = res.info;
+	  done[res.index] = true;
+	}
+    }
+  close (results[0]);
+
+  for (GSList *c = children; c; c = c->next)
+    while (waitpid (GPOINTER_TO_INT (c->data), NULL, 0) < 0
+	   && errno == EINTR)
+      ;
+  g_slist_free (children);
+}
+
+void
+cmd_get_package_infos ()
+{
+  bool only_installable_info = request.decode_int ();
+  GPtrArray *packages = g_ptr_array_new ();
+  const char *package;
+
+  while ((package = request.decode_string_in_place ()) != NULL)
+    g_ptr_array_add (packages, (gpointer) package);
+
+  int n = packages->len;
+  const char **names = (const char **) packages->pdata;
+  apt_proto_package_info *infos = g_new (apt_proto_package_info, n);
+  bool *done = g_new0 (bool, n);
+
+  /* The helpers must not build the cache on their own, since they
+     would send status messages then.
+  */
+  int n_procs = ensure_cache (true) ? package_info_processes (n) : 1;
+  if (n_procs > 1)
+    get_package_infos_parallel (n_procs, names, n, only_installable_info,
+				infos, done);
+
+  /* Everything that the helpers didn't do is done here.
+   */
+  for (int i = 0; i < n; i++)
+    {
+      if (!done[i])
+	get_package_info (names[i], only_installable_info, infos[i]);
+      response.encode_mem (&infos[i], sizeof (apt_proto_package_info));
+    }
+
+  g_free (done);
+  g_free (infos);
+  g_ptr_array_free (packages, TRUE);
+}
+
 /* APTCMD_GET_PACKAGE_DETAILS
    
    Like APTCMD_GET_PACKAGE_INFO, this command performs a simulated
@@ -4199,24 +5283,192 @@ cmd_check_updates (bool with_status)
   return result_code;
 }
 
+/* Quick checks
+
+   Most periodic checks for updates find nothing new, but a full check
+   downloads all the package indices and rebuilds the cache.  So
+   before doing that, "check-for-updates" downloads only the Release
+   files of all sources into a temporary directory and compares them
+   with the ones from the last full check.  Since a Release file lists
+   the hashes of all indices of its source, the indices can only have
+   changed when it did.
+
+   The full check is still done when the sources have changed, when
+   the last check had failures, when there is no list of available
+   updates, and when a Release file can not be downloaded or has not
+   been downloaded before.
+*/
+
+static string
+file_sha256 (const string &file)
+{
+  if (!FileExists (file))
+    return "";
+
+  FileFd Fd (file, FileFd::ReadOnly);
+  if (_error->PendingError ())
+    {
+      _error->Discard ();
+      return "";
+    }
+
+  Hashes hashes;
+  hashes.AddFD (Fd.Fd(), Fd.Size());
+  return hashes.GetHashString (Hashes::SHA256SUM).HashValue ();
+}
+
+static bool
+sources_list_changed (xexp *catalogues)
+{
+  gchar *old_contents = NULL, *new_contents = NULL;
+  bool changed;
+
+  g_file_get_contents (CATALOGUE_APT_SOURCE, &old_contents, NULL, NULL);
+  update_sources_list (catalogues);
+  g_file_get_contents (CATALOGUE_APT_SOURCE, &new_contents, NULL, NULL);
+
+  changed = (old_contents == NULL || new_contents == NULL
+	     || strcmp (old_contents, new_contents) != 0);
+
+  g_free (old_contents);
+  g_free (new_contents);
+  return changed;
+}
+
+static bool
+release_files_changed ()
+{
+  pkgSourceList List;
+  if (List.ReadMainList () == false)
+    return true;
+
+  char tmp_dir[] = "/tmp/apt-worker-release.XXXXXX";
+  if (mkdtemp (tmp_dir) == NULL)
+    {
+      log_stderr ("mkdtemp: %m");
+      return true;
+    }
+
+  bool changed = false;
+  vector<string> old_files, new_files;
+
+  {
+    pkgAcquire Fetcher;
+
+    for (pkgSourceList::const_iterator I = List.begin();
+	 I != List.end() && !changed; I++)
+      {
+	if (strcmp ((*I)->GetType(), "deb") != 0)
+	  {
+	    changed = true;
+	    break;
+	  }
+
+	debReleaseIndex *meta = (debReleaseIndex *)(*I);
+	const char *type = "InRelease";
+	string old_file = meta->MetaIndexFile (type);
+	if (!FileExists (old_file))
+	  {
+	    type = "Release";
+	    old_file = meta->MetaIndexFile (type);
+	    if (!FileExists (old_file))
+	      {
+		changed = true;
+		break;
+	      }
+	  }
+
+	char *new_file = g_strdup_printf ("%s/%d", tmp_dir,
+					  (int) new_files.size ());
+	new pkgAcqFile (&Fetcher, meta->MetaIndexURI (type),
+			HashStringList (), 0,
+			meta->GetURI () + " " + type, type,
+			"", new_file);
+	old_files.push_back (old_file);
+	new_files.push_back (new_file);
+	g_free (new_file);
+      }
+
+    if (!changed && Fetcher.Run () != pkgAcquire::Continue)
+      changed = true;
+
+    for (pkgAcquire::ItemIterator I = Fetcher.ItemsBegin();
+	 I != Fetcher.ItemsEnd() && !changed; I++)
+      if ((*I)->Status != pkgAcquire::Item::StatDone)
+	changed = true;
+  }
+
+  for (size_t i = 0; i < new_files.size (); i++)
+    {
+      if (!changed)
+	{
+	  string old_hash = file_sha256 (old_files[i]);
+	  changed = (old_hash.empty ()
+		     || old_hash != file_sha256 (new_files[i]));
+	}
+      unlink (new_files[i].c_str());
+    }
+  rmdir (tmp_dir);
+
+  /* Failed downloads are dealt with by the full check.
+   */
+  _error->Discard ();
+
+  return changed;
+}
+
+static bool
+need_full_check_for_updates ()
+{
+  xexp *catalogues = read_catalogues ();
+  bool sources_changed = sources_list_changed (catalogues);
+  string status_file = _config->FindFile ("Dir::State::status");
+  xexp_free (catalogues);
+
+  if (sources_changed)
+    DBG ("sources have changed");
+  else if (access (FAILED_CATALOGUES_FILE, F_OK) == 0)
+    DBG ("last check failed");
+  else if (access (AVAILABLE_UPDATES_FILE, F_OK) != 0)
+    DBG ("no available updates");
+  else if (file_last_modified (status_file.c_str ())
+	   >= file_last_modified (AVAILABLE_UPDATES_FILE))
+    DBG ("installed packages have changed");
+  else if (release_files_changed ())
+    DBG ("release files have changed");
+  else
+    return false;
+
+  return true;
+}
+
 int
 cmdline_check_updates (char **argv)
 {
   AptWorkerCache * awc = 0;
   int result_code = -1;
 
-  awc = AptWorkerCache::GetCurrent ();
-  awc->init_cache_after_request = false;
-
-  if (awc->cache == NULL)
-    return 2;
-
   if (argv[1])
     {
       DBG ("http_proxy: %s", argv[1]);
       setenv ("http_proxy", argv[1], 1);
     }
 
+  if (!need_full_check_for_updates ())
+    {
+      DBG ("no changes, skipping full check");
+      return 0;
+    }
+
+  misc_init_cache ();
+  finish_dpkg_recovery (false);
+
+  awc = AptWorkerCache::GetCurrent ();
+  awc->init_cache_after_request = false;
+
+  if (awc->cache == NULL)
+    return 2;
+
   response.reset ();
   request.reset (NULL, 0);
   result_code = cmd_check_updates (false);
@@ -4458,11 +5710,14 @@ cmd_get_free_space ()
 }
 
 static bool set_dir_cache_archives (const char *alt_download_root);
+static void archive_cache_note_fetch (pkgAcquire &Fetcher, bool count);
+static int64_t archive_cache_trim (const char *dir, int64_t budget);
 static int operation (bool check_only,
 		      const char *alt_download_root,
 		      bool download_only,
 		      bool allow_download = true,
 		      bool with_status = true);
+static bool archives_are_present (const char *download_root);
 
 /* APTCMD_INSTALL_CHECK
  *
@@ -4499,6 +5754,44 @@ cmd_install_check ()
 /* global variable to report the download size to the frontend */
 static int64_t download_size = 0;
 
+/* Set while APTCMD_DOWNLOAD_PACKAGE only checks where the archives
+   fit, without downloading them.  See flag_pipelined_install.
+*/
+static bool defer_download = false;
+
+/* The maximum number of bytes that the archive directory is allowed
+   to occupy after a download, or -1 when there is no limit.  Only
+   "download-updates" sets it.
+*/
+static int64_t archive_cache_budget = -1;
+
+/* Return the number of bytes used by the archives in DIR.
+ */
+static int64_t
+archive_dir_size (const char *dir)
+{
+  DIR *d = opendir (dir);
+  if (d == NULL)
+    return 0;
+
+  int64_t size = 0;
+  struct dirent *e;
+  while ((e = readdir (d)) != NULL)
+    {
+      if (!g_str_has_suffix (e->d_name, ".deb"))
+	continue;
+
+      char *file = g_strdup_printf ("%s/%s", dir, e->d_name);
+      struct stat buf;
+      if (stat (file, &buf) == 0)
+	size += buf.st_size;
+      g_free (file);
+    }
+  closedir (d);
+
+  return size;
+}
+
 static bool
 volume_is_readwrite (char* option)
 {
@@ -4601,46 +5894,64 @@ cmd_download_package ()
   if (!removable_mmc_mountpoint)
     removable_mmc_mountpoint = REMOVABLE_MMC_MOUNTPOINT;
 
+  defer_download = flag_pipelined_install;
+
   if (ensure_cache (true))
     {
       if (mark_named_package_for_install (package))
         {
-          if (flag_download_packages_to_mmc
-	      && internal_mmc_mountpoint
-              && volume_path_is_mounted_writable (internal_mmc_mountpoint))
+          /* Use the archives that "download-updates" has fetched
+             ahead, if all of them are there.
+          */
+          if (volume_path_is_mounted_writable (HOME_MOUNTPOINT)
+              && archives_are_present (HOME_MOUNTPOINT)
+              && operation (false, HOME_MOUNTPOINT, true, false)
+                 == rescode_success)
             {
-              alt_download_root = internal_mmc_mountpoint;
-              result_code = operation (false, alt_download_root, true);
+              alt_download_root = HOME_MOUNTPOINT;
+              result_code = rescode_success;
             }
-
-          if (flag_download_packages_to_mmc
-	      && result_code == rescode_out_of_space
-	      && removable_mmc_mountpoint
-              && volume_path_is_mounted_writable (removable_mmc_mountpoint))
+          else
             {
-              alt_download_root = removable_mmc_mountpoint;
-              result_code = operation (false, alt_download_root, true);
-            }
+              if (flag_download_packages_to_mmc
+	          && internal_mmc_mountpoint
+                  && volume_path_is_mounted_writable (internal_mmc_mountpoint))
+                {
+                  alt_download_root = internal_mmc_mountpoint;
+                  result_code = operation (false, alt_download_root, true);
+                }
 
-          if (result_code == rescode_out_of_space
-              && volume_path_is_mounted_writable (HOME_MOUNTPOINT))
-            {
-              alt_download_root = HOME_MOUNTPOINT;
-              result_code = operation (false, alt_download_root, true);
-            }
+              if (flag_download_packages_to_mmc
+	          && result_code == rescode_out_of_space
+	          && removable_mmc_mountpoint
+                  && volume_path_is_mounted_writable (removable_mmc_mountpoint))
+                {
+                  alt_download_root = removable_mmc_mountpoint;
+                  result_code = operation (false, alt_download_root, true);
+                }
 
-          /* default or bailout option */
-          if (!flag_download_packages_to_mmc ||
-              result_code == rescode_out_of_space)
-            {
-              alt_download_root = NULL;
-              result_code = operation (false, alt_download_root, true);
+              if (result_code == rescode_out_of_space
+                  && volume_path_is_mounted_writable (HOME_MOUNTPOINT))
+                {
+                  alt_download_root = HOME_MOUNTPOINT;
+                  result_code = operation (false, alt_download_root, true);
+                }
+
+              /* default or bailout option */
+              if (!flag_download_packages_to_mmc ||
+                  result_code == rescode_out_of_space)
+                {
+                  alt_download_root = NULL;
+                  result_code = operation (false, alt_download_root, true);
+                }
             }
         }
       else
         result_code = rescode_packages_not_found;
     }
 
+  defer_download = false;
+
   response.encode_int (result_code);
   response.encode_int64 (download_size);
   response.encode_string (alt_download_root);
@@ -4648,26 +5959,115 @@ cmd_download_package ()
   download_size = 0;
 }
 
-/* APTCMD_INSTALL_PACKAGE
- *
- * Install a package, using the common "operation ()" code, that
- * installs packages marked for install.
- */
+/* Download ahead the archives of the available updates.
 
-#define PKGNAME_ENVVAR "HAM_PKG_NAME"
+   This is started by the update notifier after a successful
+   check-for-updates, when the device is idle and on a free network.
+   The archives go to the same place that cmd_download_package tries
+   first, so that a later install finds them there and doesn't need to
+   download anything.  Nothing is downloaded when the archive
+   directory would grow beyond the budget given on the command line.
 
-/* these functions (un)export the package name to an environment variable
- * in order to be used by the package mantainer scripts.
- * The maemo-confirm-text util uses it.
- */
-static void
-set_pkgname_envvar (const char *package)
-{
-  setenv (PKGNAME_ENVVAR, package, 1);
-}
+   System updates are left out; they are installed by their own flow
+   and are normally much bigger than any budget.
+*/
 
-static void
-unset_pkgname_envvar ()
+int
+cmdline_download_updates (char **argv)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  awc->init_cache_after_request = false;
+
+  if (argv[1] == NULL)
+    usage ();
+
+  if (!ensure_cache (false))
+    return 2;
+
+  archive_cache_budget = g_ascii_strtoll (argv[1], NULL, 10);
+  if (archive_cache_budget <= 0)
+    return 0;
+
+  if (argv[2])
+    {
+      DBG ("http_proxy: %s", argv[2]);
+      setenv ("http_proxy", argv[2], 1);
+    }
+
+  pkgDepCache &cache = *(awc->cache);
+  package_record rec;
+  int n_updates = 0;
+
+  cache_reset ();
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      /* The same criteria as in write_available_updates_file.
+       */
+      pkgCache::VerIterator installed = pkg.CurrentVer ();
+      pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
+      bool broken = (cache[pkg].NowBroken()
+		     || (pkg.State () != pkgCache::PkgIterator::NeedsNothing));
+
+      if (!candidate.end ()
+	  && !installed.end()
+	  && installed.CompareVer (candidate) < 0
+	  && is_user_package (candidate)
+	  && !broken)
+	{
+	  rec.lookup (candidate);
+	  if (get_flags (rec) & pkgflag_system_update)
+	    continue;
+
+	  mark_for_install_1 (pkg, 0);
+	  n_updates++;
+	}
+    }
+
+  if (n_updates == 0)
+    return 0;
+
+  fix_soft_packages ();
+
+  const char *alt_download_root = NULL;
+  if (volume_path_is_mounted_writable (HOME_MOUNTPOINT))
+    alt_download_root = HOME_MOUNTPOINT;
+
+  /* Make room by evicting archives that are no longer needed.
+   */
+  if (set_dir_cache_archives (alt_download_root))
+    archive_cache_trim (_config->FindDir ("Dir::Cache::Archives").c_str (),
+			archive_cache_budget);
+
+  response.reset ();
+  request.reset (NULL, 0);
+  int result_code = operation (false, alt_download_root, true, true, false);
+
+  _error->DumpErrors ();
+  cache_reset ();
+
+  return result_code == rescode_success ? 0 : 1;
+}
+
+/* APTCMD_INSTALL_PACKAGE
+ *
+ * Install a package, using the common "operation ()" code, that
+ * installs packages marked for install.
+ */
+
+#define PKGNAME_ENVVAR "HAM_PKG_NAME"
+
+/* these functions (un)export the package name to an environment variable
+ * in order to be used by the package mantainer scripts.
+ * The maemo-confirm-text util uses it.
+ */
+static void
+set_pkgname_envvar (const char *package)
+{
+  setenv (PKGNAME_ENVVAR, package, 1);
+}
+
+static void
+unset_pkgname_envvar ()
 {
   unsetenv (PKGNAME_ENVVAR);
 }
@@ -4897,7 +6297,7 @@ void
 cmd_autoremove ()
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  pkgDepCache &cache = *(awc->cache);
+  myDepCache &cache = *awc->cache->dep_cache ();
 
   int result_code = rescode_failure;
 
@@ -4911,9 +6311,9 @@ cmd_autoremove ()
 
           if (Pkg.CurrentVer () != 0 &&
               Pkg->CurrentState != pkgCache::State::ConfigFiles)
-            cache.MarkDelete (Pkg, false);
+            cache.mark_delete (Pkg, false);
           else
-            cache.MarkKeep (Pkg, false, false);
+            cache.mark_keep (Pkg, false, false);
         }
     }
 
@@ -5085,8 +6485,7 @@ reset_new_domains ()
   pkgDepCache &cache = *(awc->cache);
   int package_count = cache.Head().PackageCount;
 
-  for (int i = 0; i < package_count; i++)
-    awc->cache->extra_info[i].new_domain = DOMAIN_UNSIGNED;
+  memset (awc->cache->new_domain, DOMAIN_UNSIGNED, package_count);
 }
 
 static void
@@ -5094,13 +6493,10 @@ collect_new_domains ()
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
 
-  pkgDepCache &cache = *(awc->cache);
-  int package_count = cache.Head().PackageCount;
+  myCacheFile *c = awc->cache;
 
-  for (int i = 0; i < package_count; i++)
-    if (awc->cache->extra_info[i].related)
-      awc->cache->extra_info[i].cur_domain
-        = awc->cache->extra_info[i].new_domain;
+  for (int i = c->related.next (0); i >= 0; i = c->related.next (i + 1))
+    c->cur_domain[i] = c->new_domain[i];
 }
 
 static int
@@ -5112,7 +6508,7 @@ index_trust_level_for_package (pkgIndexFile *index,
   pkgCache::PkgIterator pkg = ver.ParentPkg();
 
   int cur_level =
-    domains[awc->cache->extra_info[pkg->ID].cur_domain].trust_level;
+    domains[awc->cache->cur_domain[pkg->ID]].trust_level;
 
   int index_domain = get_domain (index);
   int index_level = domains[index_domain].trust_level;
@@ -5123,15 +6519,15 @@ index_trust_level_for_package (pkgIndexFile *index,
   /* If we have already found a good domain, accept this one only if
      it is the same domain, or strictly better.
    */
-  if (awc->cache->extra_info[pkg->ID].new_domain != DOMAIN_UNSIGNED)
+  if (awc->cache->new_domain[pkg->ID] != DOMAIN_UNSIGNED)
     {
       int new_level =
-	domains[awc->cache->extra_info[pkg->ID].new_domain].trust_level;
+	domains[awc->cache->new_domain[pkg->ID]].trust_level;
 
-      if (index_domain == awc->cache->extra_info[pkg->ID].new_domain
+      if (index_domain == awc->cache->new_domain[pkg->ID]
 	  || index_level > new_level)
 	{
-	  awc->cache->extra_info[pkg->ID].new_domain = index_domain;
+	  awc->cache->new_domain[pkg->ID] = index_domain;
 	  return index_level;
 	}
       else
@@ -5144,7 +6540,7 @@ index_trust_level_for_package (pkgIndexFile *index,
   if (cache[pkg].NewInstall())
     {
       DBG ("new: accept index");
-      awc->cache->extra_info[pkg->ID].new_domain = index_domain;
+      awc->cache->new_domain[pkg->ID] = index_domain;
       return index_level;
     }
 
@@ -5154,7 +6550,7 @@ index_trust_level_for_package (pkgIndexFile *index,
   if (index_level >= cur_level)
     {
       DBG ("upgrade: accept better");
-      awc->cache->extra_info[pkg->ID].new_domain = index_domain;
+      awc->cache->new_domain[pkg->ID] = index_domain;
       return index_level;
     }
 
@@ -5170,21 +6566,23 @@ encode_trust_summary ()
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-       pkg.end() != true;
-       pkg++)
+  update_package_sets ();
+  for (int id = upgraded_packages.next (0);
+       id >= 0;
+       id = upgraded_packages.next (id + 1))
     {
-      domain_t cur_domain = awc->cache->extra_info[pkg->ID].cur_domain;
-      domain_t new_domain = awc->cache->extra_info[pkg->ID].new_domain;
+      pkgCache::PkgIterator pkg = package_by_id (id);
+      domain_t cur_domain = awc->cache->cur_domain[pkg->ID];
+      domain_t new_domain = awc->cache->new_domain[pkg->ID];
 
-      if (cache[pkg].Upgrade() && !domains[new_domain].is_certified)
+      if (!domains[new_domain].is_certified)
 	{
 	  DBG ("not certified: %s", pkg.Name());
 	  response.encode_int (pkgtrust_not_certified);
 	  response.encode_string (pkg.Name());
 	}
 
-      if (cache[pkg].Upgrade() && !cache[pkg].NewInstall()
+      if (!cache[pkg].NewInstall()
 	  && !domain_dominates_or_is_equal (new_domain, cur_domain))
 	{
 	  log_stderr ("domain change: %s (%s -> %s)",
@@ -5207,11 +6605,13 @@ encode_upgrades ()
     {
       pkgDepCache &cache = *(awc->cache);
 
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-	   pkg.end() != true;
-	   pkg++)
+      update_package_sets ();
+      for (int id = upgraded_packages.next (0);
+	   id >= 0;
+	   id = upgraded_packages.next (id + 1))
 	{
-	  if (cache[pkg].Upgrade() && !cache[pkg].NewInstall())
+	  pkgCache::PkgIterator pkg = package_by_id (id);
+	  if (!cache[pkg].NewInstall())
 	    {
 	      response.encode_string (pkg.Name());
 	      response.encode_string (cache[pkg].CandVersion);
@@ -5238,15 +6638,30 @@ class myDPkgPM : public pkgDPkgPM
 {
 public:
 
-  bool CheckDownloadedPkgs (bool clear_corrupted);
+  bool CheckDownloadedPkgs (bool clear_corrupted,
+			    const vector<bool> *only = NULL);
+  bool SyncDownloadedPkgs (const vector<bool> *only = NULL);
+  void PreparePartialPkgs ();
+
+  bool CreateOrderList (const vector<bool> *only = NULL);
+  pkgOrderList *GetOrderList () { return pkgPackageManager::List; }
 
-  bool CreateOrderList ();
+  // For pipelined installation, see there.
+  OrderResult OrderItems () { return DoInstallPreFork (); }
+  size_t ItemCount () { return pkgDPkgPM::List.size (); }
+  size_t NextCut (size_t first, size_t installs);
+  void ItemPackages (size_t first, size_t last, vector<bool> &packages);
+  bool GoItems (size_t first, size_t last,
+		APT::Progress::PackageManager *progress);
 
   myDPkgPM(pkgDepCache *Cache);
 };
 
+/* Create the order list.  When ONLY is given, only packages whose
+   entry in it is true are considered.
+*/
 bool
-myDPkgPM::CreateOrderList ()
+myDPkgPM::CreateOrderList (const vector<bool> *only)
 {
   if (pkgPackageManager::List != 0)
     return true;
@@ -5260,6 +6675,10 @@ myDPkgPM::CreateOrderList ()
       // Ignore no-version packages
       if (I->VersionList == 0)
 	continue;
+
+      // Ignore packages that are not part of the requested subset
+      if (only && !(*only)[I->ID])
+	continue;
       
       // Not interesting
       if ((Cache[I].Keep() == true || 
@@ -5288,8 +6707,122 @@ myDPkgPM::CreateOrderList ()
   return true;
 }
 
+/* The name that pkgAcqArchive gives to the archive of VER.
+ */
+static string
+archive_file_name (const pkgCache::VerIterator &ver)
+{
+  return (QuoteString (ver.ParentPkg ().Name (), "_:") + '_'
+	  + QuoteString (ver.VerStr (), "_:") + '_'
+	  + QuoteString (ver.Arch (), "_:.") + ".deb");
+}
+
+/* The strongest digest that REC has for its archive, in the form
+   "TYPE:VALUE", or the empty string if there is none.
+*/
+static string
+expected_digest (package_record &rec)
+{
+  const char *types[] = { "SHA256", "SHA1", "MD5sum", NULL };
+
+  for (int i = 0; types[i]; i++)
+    {
+      string value = rec.get_string (types[i]);
+      if (!value.empty ())
+	return string (types[i]) + ":" + value;
+    }
+
+  return "";
+}
+
+/* Partially downloaded archives are kept in the "partial/"
+   subdirectory so that the http method can resume them with a range
+   request after a failed download or a restart of the worker.  Next
+   to each of them we keep the digest that the complete archive is
+   expected to have, in a file with the suffix ".digest".
+
+   This function must be called before the archives are queued for
+   download.  It throws away partial files that we can't trust to be
+   a prefix of the archive that we are about to download: those
+   without a matching digest, those that are too big, and those that
+   don't start like a Debian archive.  Then it records the digests for
+   the downloads that are about to start.
+*/
+void
+myDPkgPM::PreparePartialPkgs ()
+{
+  package_record rec;
+  string archive_dir = _config->FindDir ("Dir::Cache::Archives");
+  string partial_dir = archive_dir + "partial/";
+
+  for (pkgOrderList::iterator I = pkgPackageManager::List->begin();
+       I != pkgPackageManager::List->end(); I++)
+    {
+      PkgIterator Pkg(Cache,*I);
+      pkgCache::VerIterator ver = Cache[Pkg].InstVerIter(Cache);
+
+      if (ver.end () || Cache[Pkg].Delete ())
+	continue;
+
+      rec.lookup (ver);
+      string digest = expected_digest (rec);
+      if (digest.empty ())
+	continue;
+
+      string name = archive_file_name (ver);
+      string partial = partial_dir + name;
+      string digest_file = partial + ".digest";
+
+      /* Already complete */
+      struct stat buf;
+      if (stat ((archive_dir + name).c_str (), &buf) == 0)
+	continue;
+
+      if (stat (partial.c_str (), &buf) == 0)
+	{
+	  bool valid = (buf.st_size < (off_t) ver->Size);
+
+	  if (valid)
+	    {
+	      gchar *old_digest = NULL;
+	      valid = (g_file_get_contents (digest_file.c_str (),
+					    &old_digest, NULL, NULL)
+		       && digest == old_digest);
+	      g_free (old_digest);
+	    }
+
+	  if (valid && buf.st_size >= 8)
+	    {
+	      char magic[8];
+	      FILE *f = fopen (partial.c_str (), "r");
+	      valid = (f != NULL
+		       && fread (magic, 1, 8, f) == 8
+		       && memcmp (magic, "!<arch>\n", 8) == 0);
+	      if (f)
+		fclose (f);
+	    }
+
+	  if (valid)
+	    {
+	      DBG ("resuming %s at %lld", partial.c_str (),
+		   (long long) buf.st_size);
+	      continue;
+	    }
+
+	  log_stderr ("discarding partial download %s", partial.c_str ());
+	  if (unlink (partial.c_str ()) < 0)
+	    log_stderr ("%s: %m", partial.c_str ());
+	}
+
+      if (!g_file_set_contents (digest_file.c_str (), digest.c_str (), -1,
+				NULL))
+	log_stderr ("can't write %s", digest_file.c_str ());
+    }
+}
+
 bool
-myDPkgPM::CheckDownloadedPkgs (bool clean_corrupted)
+myDPkgPM::CheckDownloadedPkgs (bool clean_corrupted,
+			       const vector<bool> *only)
 {
   bool result = true;
   package_record rec;
@@ -5299,6 +6832,8 @@ myDPkgPM::CheckDownloadedPkgs (bool clean_corrupted)
     {
       bool partial_result = true;
       PkgIterator Pkg(Cache,*I);
+      if (only && !(*only)[Pkg->ID])
+	continue;
       pkgCache::VerIterator cand_ver = Cache[Pkg].CandidateVerIter(Cache);
 
       rec.lookup(cand_ver);
@@ -5360,6 +6895,160 @@ myDPkgPM::CheckDownloadedPkgs (bool clean_corrupted)
   return result;
 }
 
+/* Flush FILENAME to disk.  FILENAME can also name a directory, in
+   which case its entries are flushed.
+*/
+static bool
+fsync_path (const char *filename)
+{
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+      log_stderr ("can't open %s: %m", filename);
+      return false;
+    }
+
+  bool result = true;
+  if (fsync (fd) < 0)
+    {
+      log_stderr ("can't sync %s: %m", filename);
+      result = false;
+    }
+
+  close (fd);
+  return result;
+}
+
+/* Make sure that the archives of the current operation are on disk,
+   together with the directory entries pointing to them.  We do this
+   instead of a global sync() since that would also flush all the
+   unrelated dirty data of the system, which can take a long time.
+*/
+bool
+myDPkgPM::SyncDownloadedPkgs (const vector<bool> *only)
+{
+  bool result = true;
+  GHashTable *dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+					    g_free, NULL);
+
+  for (pkgOrderList::iterator I = pkgPackageManager::List->begin(); 
+       I != pkgPackageManager::List->end(); I++)
+    {
+      PkgIterator Pkg(Cache,*I);
+      if (only && !(*only)[Pkg->ID])
+	continue;
+      string File = FileNames[Pkg->ID];
+      if (File.empty())
+        continue;
+
+      if (!fsync_path (File.c_str()))
+	result = false;
+
+      char *dir = g_path_get_dirname (File.c_str());
+      if (g_hash_table_lookup_extended (dirs, dir, NULL, NULL))
+	g_free (dir);
+      else
+	g_hash_table_insert (dirs, dir, NULL);
+    }
+
+  GHashTableIter iter;
+  gpointer dir;
+  g_hash_table_iter_init (&iter, dirs);
+  while (g_hash_table_iter_next (&iter, &dir, NULL))
+    {
+      if (!fsync_path ((const char *) dir))
+	result = false;
+    }
+
+  g_hash_table_destroy (dirs);
+  return result;
+}
+
+/* Return the end of the slice of the ordered items that starts at
+   FIRST and unpacks at least INSTALLS archives, or all remaining
+   items if there is no suitable place to cut.
+
+   We only cut right before an unpack that follows another unpack or
+   a configuration.  pkgDPkgPM::Go itself splits runs of the same
+   action into several dpkg calls when the command line gets too
+   long, so this doesn't ask more of dpkg than apt already does.  In
+   particular, a removal always stays in the same slice as the
+   unpack that follows it.
+*/
+size_t
+myDPkgPM::NextCut (size_t first, size_t installs)
+{
+  size_t n = pkgDPkgPM::List.size ();
+  size_t seen = 0;
+
+  for (size_t i = first; i < n; i++)
+    {
+      Item::Ops op = pkgDPkgPM::List[i].Op;
+
+      if (i > first && seen >= installs && op == Item::Install)
+	{
+	  Item::Ops prev = pkgDPkgPM::List[i-1].Op;
+	  if (prev == Item::Install || prev == Item::Configure)
+	    return i;
+	}
+
+      if (op == Item::Install)
+	seen++;
+    }
+
+  return n;
+}
+
+/* Mark the packages that are unpacked by the items from FIRST up to
+   LAST in PACKAGES.
+*/
+void
+myDPkgPM::ItemPackages (size_t first, size_t last, vector<bool> &packages)
+{
+  packages.assign (Cache.Head().PackageCount, false);
+
+  for (size_t i = first; i < last; i++)
+    {
+      Item &item = pkgDPkgPM::List[i];
+      if (item.Op == Item::Install && !item.Pkg.end ())
+	packages[item.Pkg->ID] = true;
+    }
+}
+
+/* Run dpkg for the items from FIRST up to LAST.  The items must have
+   been ordered with OrderItems.
+*/
+bool
+myDPkgPM::GoItems (size_t first, size_t last,
+		   APT::Progress::PackageManager *progress)
+{
+  vector<Item> all;
+  all.swap (pkgDPkgPM::List);
+  pkgDPkgPM::List.assign (all.begin () + first, all.begin () + last);
+
+  /* Go normally finishes with "dpkg --configure --pending".  That
+     must wait for the last slice since it would also try to
+     configure packages whose dependencies are not unpacked yet.
+  */
+  bool final_slice = (last == all.size ());
+  string pending = _config->Find ("DPkg::ConfigurePending");
+  if (!final_slice)
+    _config->Set ("DPkg::ConfigurePending", "false");
+
+  bool res = Go (progress);
+
+  if (!final_slice)
+    {
+      if (pending.empty ())
+	_config->Clear ("DPkg::ConfigurePending");
+      else
+	_config->Set ("DPkg::ConfigurePending", pending);
+    }
+
+  pkgDPkgPM::List.swap (all);
+  return res;
+}
+
 myDPkgPM::myDPkgPM (pkgDepCache *Cache)
   : pkgDPkgPM (Cache)
 {
@@ -5484,13 +7173,634 @@ is_there_enough_free_space (const char *archive_dir, int64_t size)
       size += get_pkg_required_free_space ();
     }
 
-  if (size > free_space)
+  if (size > free_space)
+    {
+      log_stderr ("You don't have enough free space in %s", archive_dir);
+      return false;
+    }
+
+  return true;
+}
+
+/* Print out the errors of FETCHER and distill the failure reasons
+   into a apt_proto_rescode.
+*/
+static int
+fetch_result (pkgAcquire &Fetcher)
+{
+  int result = rescode_success;
+  for (pkgAcquire::ItemIterator I = Fetcher.ItemsBegin();
+       I != Fetcher.ItemsEnd(); I++)
+    {
+      if ((*I)->Status == pkgAcquire::Item::StatDone &&
+	  (*I)->Complete == true)
+	continue;
+
+      if ((*I)->Status == pkgAcquire::Item::StatIdle)
+	continue;
+
+      fprintf (stderr,
+	       "Failed to fetch %s: %s\n",
+	       (*I)->DescURI().c_str(),
+	       (*I)->ErrorText.c_str());
+
+      int this_result;
+
+      if (g_str_has_prefix ((*I)->ErrorText.c_str(), "404"))
+	this_result = rescode_packages_not_found;
+      else if (g_str_has_prefix ((*I)->ErrorText.c_str(), 
+				 "Size mismatch"))
+	this_result = rescode_package_corrupted;
+      else if (g_str_has_prefix ((*I)->ErrorText.c_str(), 
+				 "MD5Sum mismatch"))
+	this_result = rescode_package_corrupted;
+      else
+	this_result = rescode_failure;
+
+      result = combine_rescodes (result, this_result);
+    }
+
+  return (result == rescode_failure)? rescode_download_failed : result;
+}
+
+/** INSTALLATION TIMINGS
+
+    The percentages in the "pmstatus:" lines of libapt-pkg count every
+    dpkg step the same, so the progress bar crawls through a big
+    system update and then flies through its small packages.
+
+    Therefore, we remember how long unpacking and configuring each
+    package took, together with its installed size, in
+    PACKAGE_TIMINGS_FILE.  During an installation, the expected
+    durations are used to weigh the steps.  Besides the weighted
+    "pmstatus:" lines, "pmeta:SECONDS" lines with the estimated time
+    remaining are written to the status fd.  The file grows with
+    every package ever installed and is written in the binary xexp
+    format.
+
+    Packages that we haven't seen yet are estimated from their size,
+    using the average speed of all known packages.
+*/
+
+struct package_timing {
+  int64_t size;
+  double unpack;
+  double configure;
+};
+
+/* Don't let the file grow without bounds.
+ */
+#define MAX_PACKAGE_TIMINGS 1000
+
+static GHashTable *package_timings = NULL;
+
+static void
+load_package_timings ()
+{
+  if (package_timings)
+    return;
+
+  package_timings = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   g_free, g_free);
+
+  xexp *x = xexp_read_file (PACKAGE_TIMINGS_FILE);
+  if (x == NULL)
+    return;
+
+  for (xexp *p = xexp_first (x); p; p = xexp_rest (p))
+    {
+      const char *name = xexp_aref_text (p, "name");
+      const char *size = xexp_aref_text (p, "size");
+      const char *unpack = xexp_aref_text (p, "unpack");
+      const char *configure = xexp_aref_text (p, "configure");
+
+      if (name == NULL || size == NULL || unpack == NULL || configure == NULL)
+	continue;
+
+      package_timing *t = g_new (package_timing, 1);
+      t->size = g_ascii_strtoll (size, NULL, 10);
+      t->unpack = g_ascii_strtod (unpack, NULL);
+      t->configure = g_ascii_strtod (configure, NULL);
+      g_hash_table_replace (package_timings, g_strdup (name), t);
+    }
+
+  xexp_free (x);
+}
+
+static void
+save_package_timings ()
+{
+  if (package_timings == NULL)
+    return;
+
+  xexp *x = xexp_list_new ("timings");
+  GHashTableIter iter;
+  gpointer key, value;
+  char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  g_hash_table_iter_init (&iter, package_timings);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      package_timing *t = (package_timing *) value;
+      xexp *p = xexp_list_new ("pkg");
+      char *size = g_strdup_printf ("%lld", (long long) t->size);
+
+      xexp_cons (p, xexp_text_new ("configure",
+				   g_ascii_formatd (buf, sizeof (buf), "%.2f",
+						    t->configure)));
+      xexp_cons (p, xexp_text_new ("unpack",
+				   g_ascii_formatd (buf, sizeof (buf), "%.2f",
+						    t->unpack)));
+      xexp_cons (p, xexp_text_new ("size", size));
+      xexp_cons (p, xexp_text_new ("name", (const char *) key));
+      xexp_cons (x, p);
+      g_free (size);
+    }
+
+  xexp_write_binary_file (PACKAGE_TIMINGS_FILE, x);
+  xexp_free (x);
+}
+
+/* Estimate how long the unpack (or configure) step of a package with
+   NAME and SIZE will take.
+*/
+static double
+expected_duration (const char *name, int64_t size, bool configure)
+{
+  package_timing *t =
+    (package_timing *) g_hash_table_lookup (package_timings, name);
+
+  if (t)
+    {
+      double d = configure? t->configure : t->unpack;
+
+      /* Scale with the size, but not too much: a lot of the time goes
+	 to maintainer scripts.
+      */
+      if (t->size > 0 && size > 0)
+	d *= CLAMP ((double) size / t->size, 0.5, 2.0);
+      return d;
+    }
+
+  double total_time = 0;
+  int64_t total_size = 0;
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, package_timings);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      t = (package_timing *) value;
+      total_time += configure? t->configure : t->unpack;
+      total_size += t->size;
+    }
+
+  if (total_size > 0)
+    return 0.1 + total_time * size / total_size;
+
+  /* Nothing known, a wild guess.
+   */
+  return configure? 0.5 : 0.5 + size / 2e6;
+}
+
+/* Strip the architecture qualifier that libapt-pkg might add.
+ */
+static string
+timing_key (const string &PackageName)
+{
+  return PackageName.substr (0, PackageName.find (':'));
+}
+
+class TimedProgressFd : public APT::Progress::PackageManagerProgressFd
+{
+  struct step {
+    int64_t size;
+    double expected[2];
+    double measured[2];
+  };
+
+  int fd;
+  map<string, step> steps;
+  double total_expected;
+  double done_expected;
+  double done_measured;
+
+  GTimer *timer;
+  string cur_name;
+  int cur_phase;
+  double cur_start;
+
+  static bool
+  is_configure_action (const string &name, const string &action)
+  {
+    const char *formats[] = {
+      "Preparing to configure %s",
+      "Configuring %s",
+      "Installed %s",
+      NULL
+    };
+
+    for (int i = 0; formats[i]; i++)
+      {
+	char *a = g_strdup_printf (dgettext ("apt", formats[i]), name.c_str ());
+	bool match = (action == a);
+	g_free (a);
+	if (match)
+	  return true;
+      }
+    return false;
+  }
+
+  /* Account the time since the last status change to the step that
+     was running.
+  */
+  void
+  end_current_step ()
+  {
+    double now = g_timer_elapsed (timer, NULL);
+
+    if (!cur_name.empty ())
+      {
+	step &s = steps[cur_name];
+	s.measured[cur_phase] += now - cur_start;
+      }
+    cur_start = now;
+  }
+
+public:
+
+  TimedProgressFd (int fd, myDPkgPM &Pm)
+    : PackageManagerProgressFd (fd), fd (fd),
+      total_expected (0), done_expected (0), done_measured (0),
+      cur_phase (0), cur_start (0)
+  {
+    AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+    pkgDepCache &Cache = *(awc->cache);
+    pkgOrderList *List = Pm.GetOrderList ();
+
+    load_package_timings ();
+
+    for (pkgOrderList::iterator I = List->begin(); I != List->end(); I++)
+      {
+	pkgCache::PkgIterator Pkg (Cache, *I);
+	pkgCache::VerIterator ver = Cache[Pkg].InstVerIter(Cache);
+	if (ver.end () || Cache[Pkg].Delete ())
+	  continue;
+
+	step s;
+	s.size = ver->InstalledSize;
+	for (int phase = 0; phase < 2; phase++)
+	  {
+	    s.expected[phase] = expected_duration (Pkg.Name (), s.size,
+						   phase == 1);
+	    s.measured[phase] = 0;
+	    total_expected += s.expected[phase];
+	  }
+	steps[Pkg.Name ()] = s;
+      }
+
+    timer = g_timer_new ();
+  }
+
+  virtual ~TimedProgressFd ()
+  {
+    g_timer_destroy (timer);
+  }
+
+  virtual bool
+  StatusChanged (std::string PackageName,
+		 unsigned int StepsDone,
+		 unsigned int TotalSteps,
+		 std::string HumanReadableAction)
+  {
+    string name = timing_key (PackageName);
+    int phase = is_configure_action (name, HumanReadableAction)? 1 : 0;
+
+    end_current_step ();
+
+    if (name != cur_name || phase != cur_phase)
+      {
+	/* The previous step is finished.
+	 */
+	if (!cur_name.empty () && steps.count (cur_name))
+	  {
+	    step &s = steps[cur_name];
+	    done_expected += s.expected[cur_phase];
+	    done_measured += s.measured[cur_phase];
+	  }
+	cur_name = name;
+	cur_phase = phase;
+      }
+
+    if (total_expected <= 0 || steps.count (name) == 0)
+      return PackageManagerProgressFd::StatusChanged (PackageName, StepsDone,
+						      TotalSteps,
+						      HumanReadableAction);
+
+    /* We are somewhere in the current step, assume half way.
+     */
+    double done = done_expected + steps[name].expected[phase] / 2;
+    double fraction = CLAMP (done / total_expected, 0.0, 1.0);
+
+    /* Correct for this device being faster or slower than the
+       history, once there is enough to go by.
+    */
+    double speed = 1.0;
+    if (done_expected > 5.0)
+      speed = CLAMP (done_measured / done_expected, 0.25, 4.0);
+    int eta = (int) ((total_expected - done) * speed);
+
+    bool res = PackageManagerProgressFd::StatusChanged
+      (PackageName, (unsigned int) (fraction * 1000), 1000,
+       HumanReadableAction);
+
+    char *line = g_strdup_printf ("pmeta:%d\n", MAX (eta, 0));
+    if (write (fd, line, strlen (line)) < 0)
+      log_stderr ("status fd: %m");
+    g_free (line);
+
+    return res;
+  }
+
+  /* Remember the durations of the steps that have been seen.
+   */
+  void
+  Save ()
+  {
+    end_current_step ();
+
+    for (map<string, step>::iterator I = steps.begin ();
+	 I != steps.end (); I++)
+      {
+	step &s = I->second;
+	if (s.measured[0] <= 0 && s.measured[1] <= 0)
+	  continue;
+
+	package_timing *t =
+	  (package_timing *) g_hash_table_lookup (package_timings,
+						  I->first.c_str ());
+	if (t == NULL)
+	  {
+	    if (g_hash_table_size (package_timings) >= MAX_PACKAGE_TIMINGS)
+	      continue;
+	    t = g_new0 (package_timing, 1);
+	    g_hash_table_replace (package_timings,
+				  g_strdup (I->first.c_str ()), t);
+	  }
+
+	t->size = s.size;
+	if (s.measured[0] > 0)
+	  t->unpack = s.measured[0];
+	if (s.measured[1] > 0)
+	  t->configure = s.measured[1];
+      }
+
+    save_package_timings ();
+  }
+};
+
+/* Verify the archives of PM and run dpkg on them.
+ */
+static int
+verify_archives (myDPkgPM &Pm, const vector<bool> *only, bool with_status)
+{
+  if (with_status)
+    send_status (op_general, -1, 0, 0);
+
+  if (Pm.CheckDownloadedPkgs (true, only) == false)
+    return rescode_package_corrupted;
+
+  /* Make sure the archives are on disk before installing.  If that
+     fails for some reason, fall back to syncing everything.
+  */
+  GTimer *timer = g_timer_new ();
+  if (!Pm.SyncDownloadedPkgs (only))
+    sync ();
+  log_stderr ("syncing archives took %.3f seconds",
+	      g_timer_elapsed (timer, NULL));
+  g_timer_destroy (timer);
+
+  return rescode_success;
+}
+
+static int
+install_archives (myDPkgPM &Pm, bool with_status)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  int result = verify_archives (Pm, NULL, with_status);
+  if (result != rescode_success)
+    return result;
+
+  /* Do install */
+  _system->UnLock();
+  TimedProgressFd progress_mgr (status_fd, Pm);
+  if (with_status)
+    start_query_server ();
+  pkgPackageManager::OrderResult Res = Pm.DoInstall (&progress_mgr);
+  stop_query_server ();
+  _system->Lock();
+
+  progress_mgr.Save ();
+
+  awc->cache->save_extra_info ();
+
+  if (Res == pkgPackageManager::Failed || 
+      _error->PendingError() == true)
+    return rescode_failure;
+
+  if (Res != pkgPackageManager::Completed)
+    return rescode_failure;
+
+  return rescode_success;
+}
+
+/* Pipelined installation.
+
+   When an operation needs many archives, we don't want to wait for
+   all of them to be downloaded before starting to unpack.  Instead,
+   apt orders the whole operation once, as it would for a normal
+   installation, and the resulting list of dpkg actions is cut into
+   consecutive slices.  The slices are installed one after the other
+   while the archives of the next slice are downloaded by a child
+   process.
+
+   Since the slices are run in exactly the order that apt has
+   chosen, conflicts and pre-dependencies are handled as in a normal
+   installation.  Only where to cut needs care, see
+   myDPkgPM::NextCut.  Between slices, the package cache is not
+   consulted again: everything is decided by the single ordering
+   done up front.
+
+   This is only done for operations that don't remove anything.
+   Everything else is handled by the serial code in OPERATION, as is
+   every operation when pipelining is not enabled with the "P"
+   option.
+*/
+
+#define PIPELINE_BATCH_SIZE 8
+
+/* Download the archives of the packages in the order list of PM.
+ */
+static int
+fetch_batch (pkgCacheFile &Cache, pkgRecords &Recs, pkgSourceList &List,
+	     myDPkgPM &Pm, bool with_status)
+{
+  DownloadStatus Stat;
+  pkgAcquire Fetcher (with_status? &Stat : NULL);
+
+  if (Pm.GetArchives(&Fetcher,&List,&Recs) == false ||
+      _error->PendingError() == true)
+    return rescode_failure;
+
+  double FetchBytes = Fetcher.FetchNeeded() - Fetcher.PartialPresent();
+  if (with_status && (int)FetchBytes > 0)
+    send_status (op_downloading, 0, (int)FetchBytes, 0);
+
+  if (Fetcher.Run() == pkgAcquire::Failed)
+    return rescode_failure;
+
+  int result = fetch_result (Fetcher);
+
+  if (with_status)
+    send_status (op_downloading, -1, 0, 0);
+
+  return result;
+}
+
+/* Start a child process that downloads the archives for BATCH.  The
+   child does not report any status since it would interfere with
+   the parent, and it can not be cancelled directly.  Whatever the
+   child fails to download will be fetched again by the parent.
+*/
+static pid_t
+fetch_batch_in_background (pkgCacheFile &Cache, pkgRecords &Recs,
+			   pkgSourceList &List, vector<bool> &batch)
+{
+  fflush (stdout);
+  fflush (stderr);
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      log_stderr ("fork: %m");
+      return -1;
+    }
+
+  if (pid == 0)
+    {
+      myDPkgPM Pm (Cache);
+      Pm.CreateOrderList (&batch);
+      int result = fetch_batch (Cache, Recs, List, Pm, false);
+      _error->DumpErrors ();
+      fflush (stderr);
+      _exit (result == rescode_success? 0 : 1);
+    }
+
+  return pid;
+}
+
+/* Run dpkg for the items of PM from FIRST up to LAST, whose
+   archives are those of the packages in BATCH.
+*/
+static int
+install_slice (myDPkgPM &Pm, TimedProgressFd &progress_mgr,
+	       size_t first, size_t last, vector<bool> &batch,
+	       bool with_status)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  int result = verify_archives (Pm, &batch, with_status);
+  if (result != rescode_success)
+    return result;
+
+  _system->UnLock();
+  if (with_status)
+    start_query_server ();
+  bool res = Pm.GoItems (first, last, &progress_mgr);
+  stop_query_server ();
+  _system->Lock();
+
+  awc->cache->save_extra_info ();
+
+  if (!res || _error->PendingError() == true)
+    return rescode_failure;
+
+  return rescode_success;
+}
+
+static int
+pipelined_install (pkgCacheFile &Cache, pkgRecords &Recs,
+		   pkgSourceList &List, myDPkgPM &Pm, bool with_status)
+{
+  int result = rescode_success;
+  pid_t child = -1;
+
+  pkgPackageManager::OrderResult Res = Pm.OrderItems ();
+  if (Res == pkgPackageManager::Failed || _error->PendingError() == true)
+    return rescode_failure;
+
+  vector<pair<size_t, size_t> > slices;
+  for (size_t first = 0, last; first < Pm.ItemCount (); first = last)
+    {
+      last = Pm.NextCut (first, PIPELINE_BATCH_SIZE);
+      slices.push_back (make_pair (first, last));
+    }
+
+  vector<vector<bool> > batches (slices.size ());
+  for (size_t b = 0; b < slices.size (); b++)
+    Pm.ItemPackages (slices[b].first, slices[b].second, batches[b]);
+
+  log_stderr ("installing in %d batches", (int)batches.size ());
+
+  TimedProgressFd progress_mgr (status_fd, Pm);
+
+  for (size_t b = 0; b < batches.size (); b++)
+    {
+      /* Wait for the background download of this batch, if any.  We
+	 then run the fetcher for it in any case; it only needs to
+	 get what the child has not been able to get.
+      */
+      if (child > 0)
+	{
+	  int status;
+	  if (waitpid (child, &status, 0) < 0)
+	    log_stderr ("waitpid: %m");
+	  else if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+	    log_stderr ("background download of batch %d failed", (int)b);
+	  child = -1;
+	}
+
+      {
+	myDPkgPM FetchPm (Cache);
+	FetchPm.CreateOrderList (&batches[b]);
+	result = fetch_batch (Cache, Recs, List, FetchPm, with_status);
+      }
+      if (result != rescode_success)
+	break;
+
+      if (b + 1 < batches.size ())
+	child = fetch_batch_in_background (Cache, Recs, List, batches[b+1]);
+
+      result = install_slice (Pm, progress_mgr,
+			      slices[b].first, slices[b].second,
+			      batches[b], with_status);
+      if (result != rescode_success)
+	break;
+    }
+
+  if (child > 0)
     {
-      log_stderr ("You don't have enough free space in %s", archive_dir);
-      return false;
+      kill (child, SIGTERM);
+      waitpid (child, NULL, 0);
     }
 
-  return true;
+  progress_mgr.Save ();
+
+  if (result == rescode_success && Res != pkgPackageManager::Completed)
+    result = rescode_failure;
+
+  return result;
 }
 
 /* operation () is used to run pending apt operations
@@ -5518,7 +7828,7 @@ operation (bool check_only,
       for (; I.end() == false; I++)
 	{
 	  if (I.Purge() == false && Cache[I].Mode == pkgDepCache::ModeDelete)
-	    Cache->MarkDelete(I,true);
+	    awc->cache->dep_cache ()->mark_delete(I,true);
 	}
     }
 
@@ -5586,6 +7896,9 @@ operation (bool check_only,
 
   // Prepare to download
   //
+  if (!check_only)
+    Pm->PreparePartialPkgs ();
+
   reset_new_domains ();
   if (Pm->GetArchives(&Fetcher,&List,&Recs) == false ||
       _error->PendingError() == true)
@@ -5628,95 +7941,303 @@ operation (bool check_only,
       if (!is_there_enough_free_space
           (_config->FindDir ("Dir::Cache::Archives").c_str (), download_size))
             return rescode_out_of_space;
+
+      if (archive_cache_budget >= 0)
+	{
+	  string archive_dir = _config->FindDir ("Dir::Cache::Archives");
+	  int64_t cache_size = archive_dir_size (archive_dir.c_str ());
+
+	  if (cache_size + download_size > archive_cache_budget)
+	    {
+	      log_stderr ("%lld bytes would exceed the cache budget of %lld",
+			  (long long) (cache_size + download_size),
+			  (long long) archive_cache_budget);
+	      return rescode_out_of_space;
+	    }
+	}
+
+      /* There is room for the archives, and the install will fetch
+	 them while dpkg runs.
+      */
+      if (download_only && defer_download)
+	return rescode_success;
       
       /* Send a status report now if we are going to download
 	 something.  This makes sure that the progress dialog is
 	 shown even if the first pulse of the fetcher takes a long
 	 time to arrive.
+
+	 Like the pulses of DownloadStatus, this counts archives that
+	 are already present and the resumed parts of partial
+	 downloads as done, so that progress doesn't jump back.
       */
 
       if (with_status)
-	send_status (op_downloading, 0, (int)(FetchBytes - FetchPBytes), 0);
+	{
+	  double TotalBytes = Fetcher.TotalNeeded();
+	  send_status (op_downloading,
+		       (int)(TotalBytes - FetchBytes + FetchPBytes),
+		       (int)TotalBytes, 0);
+	}
     }
 
+  archive_cache_note_fetch (Fetcher, download_only);
+
+  if (flag_pipelined_install && !download_only
+      && Cache->DelCount() == 0)
+    return pipelined_install (Cache, Recs, List, *Pm, with_status);
+
   if (Fetcher.Run() == pkgAcquire::Failed)
     return rescode_failure;
 
-  /* Print out errors and distill the failure reasons into a
-     apt_proto_rescode.
+  int result = fetch_result (Fetcher);
+  if (result != rescode_success)
+    return result;
+
+  /* Make sure that all the packages are written to disk before
+     proceeding.  This helps with retrying the operation in case it is
+     interrupted.
   */
-  int result = rescode_success;
+
+  if (with_status)
+    send_status (op_downloading, -1, 0, 0);
+
+  /* Install packages if not just downloading */
+  if (!download_only)
+    return install_archives (*Pm, with_status);
+
+  return rescode_success;
+}
+
+/* Return true when all archives needed by the current operation are
+   already in the archive directory under DOWNLOAD_ROOT.
+
+   This only sizes the download, like the check_only mode of
+   operation (): the directory is not created, no partial downloads
+   are prepared and no cache statistics are recorded.
+*/
+static bool
+archives_are_present (const char *download_root)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgCacheFile &Cache = *(awc->cache);
+  bool result = false;
+
+  char *archives_dir = g_strdup_printf ("%s/%s", download_root,
+					ALT_DIR_CACHE_ARCHIVES);
+  if (!g_file_test (archives_dir, G_FILE_TEST_IS_DIR))
+    {
+      g_free (archives_dir);
+      return false;
+    }
+
+  string saved_dir = _config->Find ("Dir::Cache::Archives");
+  _config->Set ("Dir::Cache::Archives", archives_dir);
+
+  {
+    pkgRecords Recs (Cache);
+    pkgSourceList List;
+    pkgAcquire Fetcher;
+    myDPkgPM Pm (Cache);
+
+    if (_error->PendingError() == false
+	&& List.ReadMainList()
+	&& Pm.CreateOrderList ()
+	&& Pm.GetArchives(&Fetcher,&List,&Recs)
+	&& _error->PendingError() == false)
+      result = (Fetcher.FetchNeeded() == 0);
+  }
+
+  _config->Set ("Dir::Cache::Archives", saved_dir);
+  g_free (archives_dir);
+
+  if (_error->PendingError() == true)
+    {
+      _error->DumpErrors ();
+      result = false;
+    }
+
+  return result;
+}
+
+/** ARCHIVE CACHE
+
+    Downloaded archives are kept in the archive directory so that
+    retries and reinstallations don't need to download them again.
+    The directory is kept within a byte budget by evicting the least
+    recently used archives first.  The modification time of an archive
+    is its time of last use: it is set when the archive is downloaded
+    and refreshed whenever an operation finds it already there.
+
+    Archives of available updates are never evicted, since they will
+    be needed soon.  They might have been downloaded ahead by
+    "download-updates".
+
+    We also count how many archives were found in the cache (hits) and
+    how many had to be downloaded (misses) during the lifetime of the
+    worker.  These are reported with APTCMD_CLEAN.
+*/
+
+static int archive_cache_hits = 0;
+static int archive_cache_misses = 0;
+static int64_t archive_cache_hit_bytes = 0;
+static int64_t archive_cache_miss_bytes = 0;
+
+/* Look at the items of FETCHER before running it and refresh the
+   time of last use of the ones that are already present.  When COUNT
+   is true, the hits and misses are added to the statistics.
+*/
+static void
+archive_cache_note_fetch (pkgAcquire &Fetcher, bool count)
+{
   for (pkgAcquire::ItemIterator I = Fetcher.ItemsBegin();
        I != Fetcher.ItemsEnd(); I++)
     {
-      if ((*I)->Status == pkgAcquire::Item::StatDone &&
-	  (*I)->Complete == true)
-	continue;
+      if ((*I)->Local && (*I)->Complete)
+	{
+	  if (utime ((*I)->DestFile.c_str (), NULL) < 0)
+	    log_stderr ("%s: %m", (*I)->DestFile.c_str ());
 
-      if ((*I)->Status == pkgAcquire::Item::StatIdle)
-	continue;
+	  if (count)
+	    {
+	      archive_cache_hits += 1;
+	      archive_cache_hit_bytes += (*I)->FileSize;
+	    }
+	}
+      else if (count)
+	{
+	  archive_cache_misses += 1;
+	  archive_cache_miss_bytes += (*I)->FileSize;
+	}
+    }
+}
 
-      fprintf (stderr,
-	       "Failed to fetch %s: %s\n",
-	       (*I)->DescURI().c_str(),
-	       (*I)->ErrorText.c_str());
+/* Return the names of the archives of the available updates.  The
+   names are the keys of the returned hash table.
+*/
+static GHashTable *
+pending_update_archives ()
+{
+  GHashTable *names = g_hash_table_new_full (g_str_hash, g_str_equal,
+					     g_free, NULL);
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
 
-      int this_result;
+  if (awc->cache == NULL)
+    return names;
 
-      if (g_str_has_prefix ((*I)->ErrorText.c_str(), "404"))
-	this_result = rescode_packages_not_found;
-      else if (g_str_has_prefix ((*I)->ErrorText.c_str(), 
-				 "Size mismatch"))
-	this_result = rescode_package_corrupted;
-      else if (g_str_has_prefix ((*I)->ErrorText.c_str(), 
-				 "MD5Sum mismatch"))
-	this_result = rescode_package_corrupted;
-      else
-	this_result = rescode_failure;
+  pkgDepCache &cache = *(awc->cache);
 
-      result = combine_rescodes (result, this_result);
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      pkgCache::VerIterator installed = pkg.CurrentVer ();
+      pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
+
+      if (!candidate.end ()
+	  && !installed.end()
+	  && installed.CompareVer (candidate) < 0
+	  && is_user_package (candidate))
+	{
+	  string name = archive_file_name (candidate);
+	  g_hash_table_insert (names, g_strdup (name.c_str ()), NULL);
+	}
     }
 
-  if (result != rescode_success)
-    return (result == rescode_failure)?rescode_download_failed:result;
+  return names;
+}
 
-  /* Make sure that all the packages are written to disk before
-     proceeding.  This helps with retrying the operation in case it is
-     interrupted.
-  */
+struct archive_cache_entry {
+  string name;
+  int64_t size;
+  time_t last_use;
 
-  if (with_status)
-    send_status (op_downloading, -1, 0, 0);
+  bool operator< (const archive_cache_entry &other) const
+  {
+    return last_use < other.last_use;
+  }
+};
 
-  /* Install packages if not just downloading */
-  if (!download_only)
+/* Evict archives from DIR, least recently used first, until the
+   archives in it occupy at most BUDGET bytes.  Archives of available
+   updates are kept even when that means staying above the budget.
+   Return the number of bytes that remain in DIR.
+*/
+static int64_t
+archive_cache_trim (const char *dir, int64_t budget)
+{
+  DIR *d = opendir (dir);
+  if (d == NULL)
+    return 0;
+
+  vector<archive_cache_entry> entries;
+  int64_t total = 0;
+  struct dirent *e;
+
+  while ((e = readdir (d)) != NULL)
     {
-      if (with_status)
-	send_status (op_general, -1, 0, 0);
+      if (!g_str_has_suffix (e->d_name, ".deb"))
+	continue;
+
+      char *file = g_strdup_printf ("%s/%s", dir, e->d_name);
+      struct stat buf;
+      if (stat (file, &buf) == 0 && S_ISREG (buf.st_mode))
+	{
+	  archive_cache_entry entry;
+	  entry.name = e->d_name;
+	  entry.size = buf.st_size;
+	  entry.last_use = buf.st_mtime;
+	  entries.push_back (entry);
+	  total += buf.st_size;
+	}
+      g_free (file);
+    }
+  closedir (d);
 
-      if (Pm->CheckDownloadedPkgs (true) == false)
-        return rescode_package_corrupted;
+  /* Forget the digests of partial downloads that are gone.
+   */
+  string partial_dir = string (dir) + "/partial";
+  d = opendir (partial_dir.c_str ());
+  if (d != NULL)
+    {
+      while ((e = readdir (d)) != NULL)
+	{
+	  if (!g_str_has_suffix (e->d_name, ".digest"))
+	    continue;
 
-      // sync before installing
-      sync ();
+	  string digest_file = partial_dir + "/" + e->d_name;
+	  string partial = digest_file.substr (0, digest_file.size () - 7);
+	  if (access (partial.c_str (), F_OK) < 0 && errno == ENOENT)
+	    unlink (digest_file.c_str ());
+	}
+      closedir (d);
+    }
 
-      /* Do install */
-      _system->UnLock();
-      APT::Progress::PackageManagerProgressFd progress_mgr(status_fd);
-      pkgPackageManager::OrderResult Res = Pm->DoInstall (&progress_mgr);
-      _system->Lock();
+  if (total <= budget)
+    return total;
 
-      awc->cache->save_extra_info ();
+  GHashTable *pending = pending_update_archives ();
 
-      if (Res == pkgPackageManager::Failed || 
-	  _error->PendingError() == true)
-	return rescode_failure;
+  sort (entries.begin (), entries.end ());
+  for (vector<archive_cache_entry>::iterator I = entries.begin ();
+       I != entries.end () && total > budget; I++)
+    {
+      if (g_hash_table_lookup_extended (pending, I->name.c_str (),
+					NULL, NULL))
+	continue;
 
-      if (Res != pkgPackageManager::Completed)
-	return rescode_failure;
+      char *file = g_strdup_printf ("%s/%s", dir, I->name.c_str ());
+      if (unlink (file) < 0)
+	log_stderr ("%s: %m", file);
+      else
+	{
+	  DBG ("evicted %s", I->name.c_str ());
+	  total -= I->size;
+	}
+      g_free (file);
     }
 
-  return rescode_success;
+  g_hash_table_destroy (pending);
+
+  return total;
 }
 
 /* APTCMD_CLEAN
@@ -5725,7 +8246,9 @@ operation (bool check_only,
 void
 cmd_clean ()
 {
+  int64_t budget = request.decode_int64 ();
   bool success = true;
+  int64_t remaining = 0;
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
 
   // Try to lock the archive directory.  If that fails because we are
@@ -5754,7 +8277,12 @@ cmd_clean ()
 	Lock.Fd (fd);
     }
    
-  if (success)
+  if (success && budget >= 0)
+    {
+      string archive_dir = _config->FindDir("Dir::Cache::archives");
+      remaining = archive_cache_trim (archive_dir.c_str (), budget);
+    }
+  else if (success)
     {
       pkgAcquire Fetcher;
       Fetcher.Clean(_config->FindDir("Dir::Cache::archives"));
@@ -5765,6 +8293,11 @@ cmd_clean ()
     }
 
   response.encode_int (success);
+  response.encode_int (archive_cache_hits);
+  response.encode_int (archive_cache_misses);
+  response.encode_int64 (archive_cache_hit_bytes);
+  response.encode_int64 (archive_cache_miss_bytes);
+  response.encode_int64 (remaining);
 
   // As a special case, we try to init the cache again.  Chances are
   // good that it will now succeed because there might be more space
@@ -5807,10 +8340,173 @@ escape_for_shell (const char *str)
   return g_strdup (buf);
 }
 
+/* Reading the control record of a .deb file.
+
+   A .deb is an ar archive with the members "debian-binary",
+   "control.tar.{gz,xz,zst}" and "data.tar.*".  We find the control
+   tarball and decompress it with the help of FileFd straight from
+   its offset in the archive, reading only up to the "control" member
+   of the tarball.  Nothing is copied to a temporary file, and
+   data.tar is skipped over without touching its contents.
+
+   When any of this doesn't work out, for example because libapt-pkg
+   doesn't know the compression, we fall back to running dpkg-deb.
+*/
+
+static bool
+read_exactly (int fd, char *buf, size_t n)
+{
+  while (n > 0)
+    {
+      ssize_t r = read (fd, buf, n);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0)
+	return false;
+      buf += r;
+      n -= r;
+    }
+  return true;
+}
+
+/* Parse the decimal or octal number in the N bytes at FIELD.
+ */
+static int64_t
+parse_number_field (const char *field, size_t n, int base)
+{
+  char buf[24];
+
+  if (n >= sizeof (buf))
+    return -1;
+
+  memcpy (buf, field, n);
+  buf[n] = '\0';
+
+  char *end;
+  int64_t val = g_ascii_strtoll (buf, &end, base);
+  if (end == buf || val < 0)
+    return -1;
+
+  return val;
+}
+
+/* Position FD at the start of the control tarball of the ar archive
+   it refers to and return the extension of the member name, such as
+   ".xz".  Return NULL when there is no control tarball.
+*/
+static char *
+find_control_tarball (int fd)
+{
+  char magic[8];
+  if (!read_exactly (fd, magic, 8) || memcmp (magic, "!<arch>\n", 8))
+    return NULL;
+
+  while (true)
+    {
+      char header[60];
+      if (!read_exactly (fd, header, 60) || memcmp (header + 58, "`\n", 2))
+	return NULL;
+
+      int64_t size = parse_number_field (header + 48, 10, 10);
+      if (size < 0)
+	return NULL;
+
+      /* GNU ar terminates names with a slash, BSD ar pads them with
+	 spaces.
+      */
+      char name[17];
+      memcpy (name, header, 16);
+      name[16] = '\0';
+      g_strchomp (name);
+      if (name[0] && name[strlen (name) - 1] == '/')
+	name[strlen (name) - 1] = '\0';
+
+      if (g_str_has_prefix (name, "control.tar"))
+	return g_strdup (name + 11);
+
+      /* Members are padded to an even size.
+       */
+      if (lseek (fd, size + (size & 1), SEEK_CUR) < 0)
+	return NULL;
+    }
+}
+
+/* Return the "control" member of the tar file that starts at the
+   current position of FD and is compressed as indicated by the file
+   name extension EXTENSION.  Two extra newlines and a nul are
+   appended to the record.  Return NULL when the member can't be
+   read.
+*/
+static char *
+read_control_member (int fd, const char *extension)
+{
+  std::vector<APT::Configuration::Compressor> compressors =
+    APT::Configuration::getCompressors ();
+  std::vector<APT::Configuration::Compressor>::const_iterator c;
+  for (c = compressors.begin (); c != compressors.end (); c++)
+    if (c->Extension == extension)
+      break;
+
+  if (c == compressors.end ())
+    {
+      log_stderr ("unknown compression: control.tar%s", extension);
+      return NULL;
+    }
+
+  FileFd Fd;
+  if (!Fd.OpenDescriptor (fd, FileFd::ReadOnly, *c, false))
+    {
+      _error->Discard ();
+      return NULL;
+    }
+
+  while (true)
+    {
+      char header[512];
+      unsigned long long actual;
+      if (!Fd.Read (header, 512, &actual) || actual != 512
+	  || header[0] == '\0')
+	break;
+
+      int64_t size = parse_number_field (header + 124, 12, 8);
+      if (size < 0)
+	break;
+
+      char name[101];
+      memcpy (name, header, 100);
+      name[100] = '\0';
+
+      const char *base = name;
+      if (g_str_has_prefix (base, "./"))
+	base += 2;
+
+      char type = header[156];
+      if ((type == '0' || type == '\0') && !strcmp (base, "control"))
+	{
+	  char *record = new char[size + 3];
+	  if (!Fd.Read (record, size, &actual) || (int64_t) actual != size)
+	    {
+	      delete [] record;
+	      break;
+	    }
+	  record[size] = '\n';
+	  record[size + 1] = '\n';
+	  record[size + 2] = '\0';
+	  return record;
+	}
+
+      if (!Fd.Skip ((size + 511) & ~511))
+	break;
+    }
+
+  _error->Discard ();
+  return NULL;
+}
+
 // XXX - interpret status codes
 
 static char *
-get_deb_record (const char *filename)
+get_deb_record_with_dpkg_deb (const char *filename)
 {
   char *esc_filename = escape_for_shell (filename);
   if (esc_filename == NULL)
@@ -5862,6 +8558,35 @@ get_deb_record (const char *filename)
   return NULL;
 }
 
+static char *
+get_deb_record (const char *filename)
+{
+  char *record = NULL;
+
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+      log_stderr ("%s: %m", filename);
+      return NULL;
+    }
+
+  char *extension = find_control_tarball (fd);
+  if (extension)
+    {
+      record = read_control_member (fd, extension);
+      g_free (extension);
+    }
+  close (fd);
+
+  if (record == NULL)
+    {
+      log_stderr ("can't read control record of %s directly", filename);
+      record = get_deb_record_with_dpkg_deb (filename);
+    }
+
+  return record;
+}
+
 static bool
 check_dependency (string &package, string &version, unsigned int op)
 {
@@ -6375,7 +9100,7 @@ write_available_updates_file ()
 
 	  rec.lookup(candidate);
 	  int flags = get_flags (rec);
-	  int domain_index = awc->cache->extra_info[pkg->ID].cur_domain;
+	  int domain_index = awc->cache->cur_domain[pkg->ID];
 
           const char *pkg_name;
           string pretty_name = get_pretty_name (rec);
@@ -6395,7 +9120,10 @@ write_available_updates_file ()
 	}
     }
 
-  xexp_write_file (AVAILABLE_UPDATES_FILE, x_updates);
+  /* The status bar plugin reads this file often, so we write it in
+     the binary format, which is faster to load.
+  */
+  xexp_write_binary_file (AVAILABLE_UPDATES_FILE, x_updates);
 
   if (x_updates)
     xexp_free (x_updates);
@@ -6790,6 +9518,7 @@ do_rescue (const char *package, const char *download_root,
   fs_setup (tmpfs);
 
   misc_init ();
+  finish_dpkg_recovery (false);
 
   // @todo Is this really necessary?
   AptWorkerCache::GetCurrent ()->init_cache_after_request = false;
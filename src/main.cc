@@ -182,6 +182,27 @@ static GList *upgradeable_packages = NULL;
 static GList *installed_packages = NULL;
 static GList *search_result_packages = NULL;
 
+/* All packages in the lists above, by name.  Each entry also records
+   which of the lists the package is in, so that names coming back
+   from apt-worker can be mapped to our package_info structures
+   without scanning the lists.
+*/
+struct package_entry {
+  package_info *pi;
+  int lists;
+};
+
+enum {
+  IN_INSTALL_SECTIONS = 1 << 0,
+  IN_UPGRADEABLE      = 1 << 1,
+  IN_INSTALLED        = 1 << 2,
+  IN_ANY_LIST         = (IN_INSTALL_SECTIONS
+			 | IN_UPGRADEABLE
+			 | IN_INSTALLED)
+};
+
+static GHashTable *package_store = NULL;
+
 
 enum package_list_state {
   pkg_list_unknown,
@@ -430,6 +451,11 @@ package_info::package_info ()
   dependencies = NULL;
 
   model = NULL;
+
+  search_tokens = NULL;
+  search_tokens_installed = false;
+  search_serial = 0;
+  search_matched = false;
 }
 
 package_info::~package_info ()
@@ -458,6 +484,7 @@ package_info::~package_info ()
       g_list_free (summary_packages[i]);
     }
   g_free (dependencies);
+  g_strfreev (search_tokens);
 }
 
 const char *
@@ -550,9 +577,66 @@ free_sections (GList *list)
   g_list_free (list);
 }
 
+static void
+free_package_entry (gpointer data)
+{
+  package_entry *e = (package_entry *)data;
+
+  e->pi->unref ();
+  delete e;
+}
+
+/* Record that PI is in the list identified by LIST.
+ */
+static void
+store_package (package_info *pi, int list)
+{
+  package_entry *e;
+
+  if (package_store == NULL)
+    package_store = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   NULL, free_package_entry);
+
+  e = (package_entry *) g_hash_table_lookup (package_store, pi->name);
+  if (e == NULL)
+    {
+      e = new package_entry;
+      pi->ref ();
+      e->pi = pi;
+      e->lists = 0;
+      g_hash_table_insert (package_store, pi->name, e);
+    }
+
+  if (e->pi == pi)
+    e->lists |= list;
+}
+
+/* Return the package named NAME if it is in one of the lists
+   identified by LISTS, NULL otherwise.  No reference is added.
+ */
+static package_info *
+lookup_package (const char *name, int lists)
+{
+  package_entry *e = NULL;
+
+  if (package_store && name)
+    e = (package_entry *) g_hash_table_lookup (package_store, name);
+
+  if (e && (e->lists & lists))
+    return e->pi;
+
+  return NULL;
+}
+
 static void
 free_all_packages ()
 {
+  if (package_store)
+    {
+      g_hash_table_destroy (package_store);
+      package_store = NULL;
+    }
+
   if (install_sections)
     {
       free_sections (install_sections);
@@ -983,6 +1067,7 @@ get_package_list_reply (int cmd, apt_proto_decoder *dec, void *data)
 		  info->ref ();
 		  upgradeable_packages = g_list_prepend (upgradeable_packages,
 							 info);
+		  store_package (info, IN_UPGRADEABLE);
 		}
 	      else
 		{
@@ -995,6 +1080,7 @@ get_package_list_reply (int cmd, apt_proto_decoder *dec, void *data)
 
 		  info->ref ();
 		  all_si->packages = g_list_prepend (all_si->packages, info);
+		  store_package (info, IN_INSTALL_SECTIONS);
 		}
 	    }
 
@@ -1004,6 +1090,7 @@ get_package_list_reply (int cmd, apt_proto_decoder *dec, void *data)
 	      info->ref ();
 	      installed_packages = g_list_prepend (installed_packages,
 						   info);
+	      store_package (info, IN_INSTALLED);
 	    }
 
 	  info->unref ();
@@ -1184,10 +1271,17 @@ gpis_loop (package_info *pi, void *data, bool unused)
 }
 
 /* GET_PACKAGE_INFOS_IN_BACKGROUND
+
+   The infos are requested in batches, which the apt-worker can
+   compute on several processors at once.  The batches are small
+   enough so that other requests don't have to wait for long.
  */
 
+#define GPIIB_BATCH_SIZE 64
+
 static void gpiib_trigger ();
-static void gpiib_done (package_info *pi, void *unused, bool changed);
+static void gpiib_reply (int cmd, apt_proto_decoder *dec, void *data);
+static void gpiib_done (bool changed);
 
 static GList *gpiib_next;
 
@@ -1201,21 +1295,69 @@ get_package_infos_in_background (GList *packages)
 static void
 gpiib_trigger ()
 {
-  GList *n = gpiib_next;
-  if (n)
+  GPtrArray *batch = g_ptr_array_new ();
+
+  while (gpiib_next && batch->len < GPIIB_BATCH_SIZE)
     {
-      package_info *pi = (package_info *)n->data;
-      gpiib_next = n->next;
-      get_package_info (pi, true,
-			gpiib_done, NULL);
+      package_info *pi = (package_info *)gpiib_next->data;
+      gpiib_next = gpiib_next->next;
+      if (!pi->have_info)
+	{
+	  pi->ref ();
+	  g_ptr_array_add (batch, pi);
+	}
     }
+
+  if (batch->len == 0)
+    {
+      g_ptr_array_free (batch, TRUE);
+      gpiib_done (false);
+      return;
+    }
+
+  const char **names = g_new (const char *, batch->len + 1);
+  for (guint i = 0; i < batch->len; i++)
+    names[i] = ((package_info *)g_ptr_array_index (batch, i))->name;
+  names[batch->len] = NULL;
+
+  apt_worker_get_package_infos (names, true, gpiib_reply, batch);
+  g_free (names);
 }
 
-static void 
-gpiib_done (package_info *pi, void *data, bool changed)
+static void
+gpiib_reply (int cmd, apt_proto_decoder *dec, void *data)
 {
-  gpiib_trigger ();
+  GPtrArray *batch = (GPtrArray *)data;
 
+  for (guint i = 0; i < batch->len; i++)
+    {
+      package_info *pi = (package_info *)g_ptr_array_index (batch, i);
+
+      pi->have_info = false;
+      if (dec)
+	{
+	  dec->decode_mem (&(pi->info), sizeof (pi->info));
+	  if (!dec->corrupted ())
+	    {
+	      pi->have_info = true;
+	      global_package_info_changed (pi);
+	    }
+	}
+      pi->unref ();
+    }
+
+  gboolean changed = batch->len > 0;
+  g_ptr_array_free (batch, TRUE);
+
+  if (gpiib_next)
+    gpiib_trigger ();
+  else
+    gpiib_done (changed);
+}
+
+static void 
+gpiib_done (bool changed)
+{
   /* Resort & refresh view
    * only needed when we are sorting by size */
   if (!gpiib_next && changed &&
@@ -1938,6 +2080,7 @@ search_package_list (GList **result,
                      GList *packages, const char *pattern, bool installed)
 {
   gchar **words;
+  GList *found = NULL;
 
   if (!(words = g_strsplit (pattern, " ", 0)))
     return; /* pattern is empty */
@@ -1953,53 +2096,28 @@ search_package_list (GList **result,
           && (pi->installed_version || !package_is_hidden (pi)))
         {
           pi->ref ();
-          *result = g_list_append (*result, pi);
+          found = g_list_prepend (found, pi);
         }
 
       packages = packages->next;
     }
 
-  g_strfreev (words);
-}
+  *result = g_list_concat (*result, g_list_reverse (found));
 
-static void
-find_in_package_list (GList **result,
-		      GList *packages, const char *name)
-{
-  while (packages)
-    {
-      package_info *pi = (package_info *)packages->data;
-      
-      if (!strcmp (pi->name, name))
-	{
-	  pi->ref ();
-	  *result = g_list_append (*result, pi);
-	}
-
-      packages = packages->next;
-    }
+  g_strfreev (words);
 }
 
-static void
-find_in_section_list (GList **result,
-		      GList *sections, const char *name)
+/* Return a new reference to the package named NAME, or NULL when it
+   is in none of our lists.
+ */
+static package_info *
+find_package_in_lists (const char *name)
 {
-  while (sections)
-    {
-      section_info *si = (section_info *)sections->data;
-      find_in_package_list (result, si->packages, name);
+  package_info *pi = lookup_package (name, IN_ANY_LIST);
 
-      sections = sections->next;
-    }
-}
-
-static void
-find_package_in_lists (GList **result,
-                       const char *package_name)
-{
-      find_in_section_list (result, install_sections, package_name);
-      find_in_package_list (result, upgradeable_packages, package_name);
-      find_in_package_list (result, installed_packages, package_name);
+  if (pi)
+    pi->ref ();
+  return pi;
 }
 
 static void
@@ -2026,6 +2144,7 @@ search_packages_reply (int cmd, apt_proto_decoder *dec, void *data)
     {
       const char *name = NULL;
       package_info *info = NULL;
+      package_info *pi = NULL;
 
       info = get_package_list_entry (dec);
       name = info->name;
@@ -2049,21 +2168,26 @@ search_packages_reply (int cmd, apt_proto_decoder *dec, void *data)
                       && (!info->installed_version && package_is_hidden (info))))
                 ;
               else
-                find_in_package_list (&result, si->packages, name);
+                pi = lookup_package (name, IN_INSTALL_SECTIONS);
 	    }
 	}
       else if (parent == &upgrade_applications_view)
-	find_in_package_list (&result,
-			      upgradeable_packages, name);
+	pi = lookup_package (name, IN_UPGRADEABLE);
       else if (parent == &uninstall_applications_view)
-	find_in_package_list (&result,
-			      installed_packages, name);
+	pi = lookup_package (name, IN_INSTALLED);
+
+      if (pi)
+	{
+	  pi->ref ();
+	  result = g_list_prepend (result, pi);
+	}
+
       info->unref();
     }
 
   clear_global_package_list ();
   free_packages (search_result_packages);
-  search_result_packages = result;
+  search_result_packages = g_list_reverse (result);
 
   if (result)
     {
@@ -2184,16 +2308,13 @@ void
 install_named_package (const char *package,
                        void (*cont) (int n_successful, void *data), void *data)
 {
-  GList *p = NULL;
-  GList *node = NULL;
-
-  find_package_in_lists (&p, package);
+  package_info *pi = find_package_in_lists (package);
 
   inp_clos *c = new inp_clos;
   c->cont = cont;
   c->data = data;
 
-  if (p == NULL)
+  if (pi == NULL)
     {
       char *text = g_strdup_printf (_("ai_ni_error_download_missing"),
 				    package);
@@ -2202,7 +2323,6 @@ install_named_package (const char *package,
     }
   else
     {
-      package_info *pi = (package_info *) p->data;
       if (pi->available_version == NULL)
 	{
 	  char *text = g_strdup_printf (_("ai_ni_package_installed"),
@@ -2216,13 +2336,6 @@ install_named_package (const char *package,
 	  delete c;
 	  install_package (pi, cont, data);
 	}
-
-      for (node = p->next; node != NULL; node = g_list_next (node))
-	{
-	  pi = (package_info *) node->data;
-	  pi->unref ();
-	}
-      g_list_free (p);
     }
 }
 
@@ -2259,31 +2372,20 @@ install_named_packages (const char **packages,
        current_package != NULL && *current_package != NULL;
        current_package++)
     {
-      GList *search_list = NULL;
-      GList *node = NULL;
+      package_info *pi;
 
       g_strchug (*current_package);
 
-      find_package_in_lists (&search_list, *current_package);
+      pi = find_package_in_lists (*current_package);
 
-      if (search_list != NULL)
-	{
-	  package_info *pi = (package_info *)search_list->data;
-	  package_list = g_list_append (package_list, pi);
-
-	  for (node = search_list->next; node != NULL;
-	       node = g_list_next (node))
-	    {
-	      pi = (package_info *) node->data;
-	      pi->unref ();
-	    }
-	}
+      if (pi != NULL)
+	package_list = g_list_append (package_list, pi);
       else
 	{
 	  /* Create a 'fake' package_info structure so that we at
 	     least have something to display.
 	  */
-	  package_info *pi = new package_info;
+	  pi = new package_info;
 	  pi->name = g_strdup (*current_package);
 	  pi->available_version = g_strdup ("");
 	  pi->flags = 0;
@@ -2305,8 +2407,6 @@ install_named_packages (const char **packages,
 
 	  package_list = g_list_append (package_list, pi);
 	}
-
-      g_list_free (search_list);
     }
   
   install_packages (package_list,
@@ -90,6 +90,13 @@ struct package_info {
   GtkTreeModel *model;
   GtkTreeIter iter;
 
+  // Casefolded words of the display name and short description, as
+  // used by the live search.  See util.cc.
+  char **search_tokens;
+  bool search_tokens_installed;
+  int search_serial;
+  bool search_matched;
+
   const char *get_display_name (bool installed);
   const char *get_display_version (bool installed);
 };
@@ -1448,7 +1448,7 @@ ip_download_cur_reply (int cmd, apt_proto_decoder *dec, void *data)
       if (entertainment_was_cancelled ()
           && !entertainment_was_broke ())
         {
-          apt_worker_clean (ip_clean_reply, NULL);
+          apt_worker_clean (-1, ip_clean_reply, NULL);
           ip_end (c);
         }
       else
@@ -1583,8 +1583,11 @@ ip_install_cur_reply (int cmd, apt_proto_decoder *dec, void *data)
   if (clean_after_install
       && ((result_code == rescode_success) || !needs_reboot))
     {
-      /* Clean only when needed */
-      apt_worker_clean (ip_clean_reply, NULL);
+      /* Clean only when needed, but keep the most recently used
+         archives around for retries and reinstallations.
+      */
+      apt_worker_clean ((int64_t) archive_cache_budget * 1024 * 1024,
+                        ip_clean_reply, NULL);
     }
 
   c->refresh_needed = true;
@@ -1629,6 +1632,20 @@ ip_clean_reply (int cmd, apt_proto_decoder *dec, void *data)
      However, if cleaning takes really long, the user might get
      confused since apt-worker is not responding.
    */
+
+  if (dec == NULL)
+    return;
+
+  dec->decode_int ();
+  int hits = dec->decode_int ();
+  int misses = dec->decode_int ();
+  int64_t hit_bytes = dec->decode_int64 ();
+  int64_t miss_bytes = dec->decode_int64 ();
+  int64_t remaining = dec->decode_int64 ();
+
+  add_log ("archive cache: %d hits (%Ld bytes), %d misses (%Ld bytes), "
+           "%Ld bytes kept\n",
+           hits, hit_bytes, misses, miss_bytes, remaining);
 }
 
 static void
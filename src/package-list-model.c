@@ -0,0 +1,304 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#include "package-list-model.h"
+
+static GObjectClass *parent_class = NULL;
+
+typedef struct _PackageListModelPrivate PackageListModelPrivate;
+
+struct _PackageListModelPrivate
+{
+  GPtrArray *rows;
+  gint stamp;
+};
+
+#define PACKAGE_LIST_MODEL_GET_PRIVATE(o)	\
+  (G_TYPE_INSTANCE_GET_PRIVATE ((o), TYPE_PACKAGE_LIST_MODEL, PackageListModelPrivate))
+
+#define ITER_INDEX(iter) (GPOINTER_TO_INT ((iter)->user_data))
+
+/* static functions: GObject */
+static void package_list_model_instance_init (GTypeInstance *instance, gpointer g_class);
+static void package_list_model_finalize      (GObject *object);
+static void package_list_model_class_init    (PackageListModelClass *klass);
+
+/* static functions: GtkTreeModel */
+static void package_list_model_tree_model_init (GtkTreeModelIface *iface);
+
+/**
+ * package_list_model_new:
+ * @rows: the rows of the new model, adopted by it
+ *
+ * Return value: a new #PackageListModel instance
+ **/
+PackageListModel*
+package_list_model_new (GPtrArray *rows)
+{
+  PackageListModel *model;
+  PackageListModelPrivate *priv;
+
+  g_return_val_if_fail (rows != NULL, NULL);
+
+  model = PACKAGE_LIST_MODEL (g_object_new (TYPE_PACKAGE_LIST_MODEL, NULL));
+  priv = PACKAGE_LIST_MODEL_GET_PRIVATE (model);
+  priv->rows = rows;
+
+  return model;
+}
+
+static void
+package_list_model_instance_init (GTypeInstance *instance, gpointer g_class)
+{
+  PackageListModelPrivate *priv = PACKAGE_LIST_MODEL_GET_PRIVATE (instance);
+
+  priv->rows = NULL;
+  priv->stamp = g_random_int ();
+}
+
+static void
+package_list_model_finalize (GObject *object)
+{
+  PackageListModelPrivate *priv = PACKAGE_LIST_MODEL_GET_PRIVATE (object);
+
+  if (priv->rows != NULL)
+    g_ptr_array_free (priv->rows, TRUE);
+
+  (*parent_class->finalize) (object);
+}
+
+static void
+package_list_model_class_init (PackageListModelClass *klass)
+{
+  GObjectClass *object_class;
+
+  parent_class = g_type_class_peek_parent (klass);
+  object_class = (GObjectClass*) klass;
+
+  object_class->finalize = package_list_model_finalize;
+
+  g_type_class_add_private (object_class, sizeof (PackageListModelPrivate));
+}
+
+GType
+package_list_model_get_type (void)
+{
+  static GType type = 0;
+
+  if (G_UNLIKELY(type == 0))
+    {
+      static const GTypeInfo info =
+        {
+            sizeof (PackageListModelClass),
+            NULL,   /* base_init */
+            NULL,   /* base_finalize */
+            (GClassInitFunc) package_list_model_class_init,   /* class_init */
+            NULL,   /* class_finalize */
+            NULL,   /* class_data */
+            sizeof (PackageListModel),
+            0,      /* n_preallocs */
+            package_list_model_instance_init    /* instance_init */
+        };
+
+      static const GInterfaceInfo tree_model_info =
+        {
+            (GInterfaceInitFunc) package_list_model_tree_model_init,
+            NULL,   /* interface_finalize */
+            NULL    /* interface_data */
+        };
+
+      type = g_type_register_static (G_TYPE_OBJECT,
+                                     "PackageListModel",
+                                     &info, 0);
+
+      g_type_add_interface_static (type, GTK_TYPE_TREE_MODEL,
+                                   &tree_model_info);
+    }
+
+  return type;
+}
+
+static gboolean
+package_list_model_set_iter (PackageListModel *model,
+                             GtkTreeIter *iter, gint index)
+{
+  PackageListModelPrivate *priv = PACKAGE_LIST_MODEL_GET_PRIVATE (model);
+
+  if (index < 0 || index >= (gint) priv->rows->len)
+    return FALSE;
+
+  iter->stamp = priv->stamp;
+  iter->user_data = GINT_TO_POINTER (index);
+  return TRUE;
+}
+
+static gboolean
+package_list_model_iter_is_valid (PackageListModel *model,
+                                  GtkTreeIter *iter)
+{
+  PackageListModelPrivate *priv = PACKAGE_LIST_MODEL_GET_PRIVATE (model);
+
+  return (iter != NULL
+          && iter->stamp == priv->stamp
+          && ITER_INDEX (iter) >= 0
+          && ITER_INDEX (iter) < (gint) priv->rows->len);
+}
+
+static GtkTreeModelFlags
+package_list_model_get_flags (GtkTreeModel *tree_model)
+{
+  /* The rows never change, see package_list_model_new.
+   */
+  return (GTK_TREE_MODEL_ITERS_PERSIST | GTK_TREE_MODEL_LIST_ONLY);
+}
+
+static gint
+package_list_model_get_n_columns (GtkTreeModel *tree_model)
+{
+  return 1;
+}
+
+static GType
+package_list_model_get_column_type (GtkTreeModel *tree_model, gint index)
+{
+  g_return_val_if_fail (index == 0, G_TYPE_INVALID);
+
+  return G_TYPE_POINTER;
+}
+
+static gboolean
+package_list_model_get_iter (GtkTreeModel *tree_model,
+                             GtkTreeIter *iter,
+                             GtkTreePath *path)
+{
+  if (gtk_tree_path_get_depth (path) != 1)
+    return FALSE;
+
+  return package_list_model_set_iter (PACKAGE_LIST_MODEL (tree_model), iter,
+                                      gtk_tree_path_get_indices (path)[0]);
+}
+
+static GtkTreePath *
+package_list_model_get_path (GtkTreeModel *tree_model,
+                             GtkTreeIter *iter)
+{
+  g_return_val_if_fail (package_list_model_iter_is_valid
+                        (PACKAGE_LIST_MODEL (tree_model), iter), NULL);
+
+  return gtk_tree_path_new_from_indices (ITER_INDEX (iter), -1);
+}
+
+static void
+package_list_model_get_value (GtkTreeModel *tree_model,
+                              GtkTreeIter *iter,
+                              gint column,
+                              GValue *value)
+{
+  PackageListModelPrivate *priv = PACKAGE_LIST_MODEL_GET_PRIVATE (tree_model);
+
+  g_return_if_fail (column == 0);
+
+  g_value_init (value, G_TYPE_POINTER);
+  if (package_list_model_iter_is_valid (PACKAGE_LIST_MODEL (tree_model),
+                                        iter))
+    g_value_set_pointer (value,
+                         g_ptr_array_index (priv->rows, ITER_INDEX (iter)));
+}
+
+static gboolean
+package_list_model_iter_next (GtkTreeModel *tree_model,
+                              GtkTreeIter *iter)
+{
+  return package_list_model_set_iter (PACKAGE_LIST_MODEL (tree_model), iter,
+                                      ITER_INDEX (iter) + 1);
+}
+
+static gboolean
+package_list_model_iter_children (GtkTreeModel *tree_model,
+                                  GtkTreeIter *iter,
+                                  GtkTreeIter *parent)
+{
+  if (parent != NULL)
+    return FALSE;
+
+  return package_list_model_set_iter (PACKAGE_LIST_MODEL (tree_model), iter,
+                                      0);
+}
+
+static gboolean
+package_list_model_iter_has_child (GtkTreeModel *tree_model,
+                                   GtkTreeIter *iter)
+{
+  return FALSE;
+}
+
+static gint
+package_list_model_iter_n_children (GtkTreeModel *tree_model,
+                                    GtkTreeIter *iter)
+{
+  PackageListModelPrivate *priv = PACKAGE_LIST_MODEL_GET_PRIVATE (tree_model);
+
+  if (iter != NULL)
+    return 0;
+
+  return priv->rows->len;
+}
+
+static gboolean
+package_list_model_iter_nth_child (GtkTreeModel *tree_model,
+                                   GtkTreeIter *iter,
+                                   GtkTreeIter *parent,
+                                   gint n)
+{
+  if (parent != NULL)
+    return FALSE;
+
+  return package_list_model_set_iter (PACKAGE_LIST_MODEL (tree_model), iter,
+                                      n);
+}
+
+static gboolean
+package_list_model_iter_parent (GtkTreeModel *tree_model,
+                                GtkTreeIter *iter,
+                                GtkTreeIter *child)
+{
+  return FALSE;
+}
+
+static void
+package_list_model_tree_model_init (GtkTreeModelIface *iface)
+{
+  iface->get_flags = package_list_model_get_flags;
+  iface->get_n_columns = package_list_model_get_n_columns;
+  iface->get_column_type = package_list_model_get_column_type;
+  iface->get_iter = package_list_model_get_iter;
+  iface->get_path = package_list_model_get_path;
+  iface->get_value = package_list_model_get_value;
+  iface->iter_next = package_list_model_iter_next;
+  iface->iter_children = package_list_model_iter_children;
+  iface->iter_has_child = package_list_model_iter_has_child;
+  iface->iter_n_children = package_list_model_iter_n_children;
+  iface->iter_nth_child = package_list_model_iter_nth_child;
+  iface->iter_parent = package_list_model_iter_parent;
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+/* A GtkTreeModel with a single G_TYPE_POINTER column that reads its
+   rows directly from an array of pointers.  It is used for the
+   package lists, where the rows are package_info structures.
+
+   Iterators are just indices into the array, so getting an iterator
+   for a path and moving to the next row are O(1).
+*/
+
+#ifndef PACKAGE_LIST_MODEL_H
+#define PACKAGE_LIST_MODEL_H
+#include <glib-object.h>
+#include <gtk/gtktreemodel.h>
+
+G_BEGIN_DECLS
+
+#define TYPE_PACKAGE_LIST_MODEL             (package_list_model_get_type ())
+#define PACKAGE_LIST_MODEL(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_PACKAGE_LIST_MODEL, PackageListModel))
+#define PACKAGE_LIST_MODEL_CLASS(vtable)    (G_TYPE_CHECK_CLASS_CAST ((vtable), TYPE_PACKAGE_LIST_MODEL, PackageListModelClass))
+#define IS_PACKAGE_LIST_MODEL(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TYPE_PACKAGE_LIST_MODEL))
+#define IS_PACKAGE_LIST_MODEL_CLASS(vtable) (G_TYPE_CHECK_CLASS_TYPE ((vtable), TYPE_PACKAGE_LIST_MODEL))
+#define PACKAGE_LIST_MODEL_GET_CLASS(inst)  (G_TYPE_INSTANCE_GET_CLASS ((inst), TYPE_PACKAGE_LIST_MODEL, PackageListModelClass))
+
+typedef struct _PackageListModel PackageListModel;
+typedef struct _PackageListModelClass PackageListModelClass;
+
+struct _PackageListModel
+{
+  GObject parent;
+
+};
+
+struct _PackageListModelClass
+{
+  GObjectClass parent_class;
+
+};
+
+GType package_list_model_get_type (void);
+
+/* Return a new model whose rows are the pointers in ROWS.  The model
+   takes over ROWS itself, but not the data that the pointers point
+   to.  The rows can not be changed afterwards; a different list gets
+   a new model.
+*/
+PackageListModel* package_list_model_new (GPtrArray *rows);
+
+G_END_DECLS
+
+#endif
@@ -39,12 +39,14 @@
 
 int  package_sort_key = SORT_BY_NAME;
 int  package_sort_sign = 1;
+int  archive_cache_budget = 50;  /* MiB */
 
 bool clean_after_install = true;
 bool assume_connection = false;
 bool break_locks = false;
 bool download_packages_to_mmc = true;
 bool use_apt_algorithms = false;
+bool pipelined_install = false;
 bool red_pill_mode = false;
 bool red_pill_show_deps = true;
 bool red_pill_show_all = true;
@@ -93,12 +95,16 @@ load_settings ()
 	    package_sort_key = val;
 	  else if (sscanf (line, "package-sort-sign %d", &val) == 1)
 	    package_sort_sign = val;
+	  else if (sscanf (line, "archive-cache-budget %d", &val) == 1)
+	    archive_cache_budget = val;
 	  else if (sscanf (line, "break-locks %d", &val) == 1)
 	    break_locks = val;
 	  else if (sscanf (line, "download-packages-to-mmc %d", &val) == 1)
 	    download_packages_to_mmc = val;
 	  else if (sscanf (line, "use-apt-algorithms %d", &val) == 1)
 	    use_apt_algorithms = val;
+	  else if (sscanf (line, "pipelined-install %d", &val) == 1)
+	    pipelined_install = val;
 	  else if (sscanf (line, "red-pill-mode %d", &val) == 1)
 	    red_pill_mode = val;
 	  else if (sscanf (line, "red-pill-show-deps %d", &val) == 1)
@@ -146,9 +152,11 @@ save_settings ()
       fprintf (f, "clean-after-install %d\n", clean_after_install);
       fprintf (f, "package-sort-key %d\n", package_sort_key);
       fprintf (f, "package-sort-sign %d\n", package_sort_sign);
+      fprintf (f, "archive-cache-budget %d\n", archive_cache_budget);
       fprintf (f, "break-locks %d\n", break_locks);
       fprintf (f, "download-packages-to-mmc %d\n", download_packages_to_mmc);
       fprintf (f, "use-apt-algorithms %d\n", use_apt_algorithms);
+      fprintf (f, "pipelined-install %d\n", pipelined_install);
       fprintf (f, "red-pill-mode %d\n", red_pill_mode);
       fprintf (f, "red-pill-show-deps %d\n", red_pill_show_deps);
       fprintf (f, "red-pill-show-all %d\n", red_pill_show_all);
@@ -181,6 +189,7 @@ enum boolean_options {
   OPT_IGNORE_WRONG_DOMAINS,
   OPT_IGNORE_THIRDPARTY_POLICY,
   OPT_USE_APT_ALGORITHMS,
+  OPT_PIPELINED_INSTALL,
   OPT_SHOW_SSU_PROBLEMS,
   OPT_PERMANENT,
   NUM_BOOLEAN_OPTIONS
@@ -255,6 +264,9 @@ make_settings_tab (settings_closure *c)
   make_boolean_option (c, vbox, group, OPT_USE_APT_ALGORITHMS,
 		       "Use apt-get algorithms",
 		       &use_apt_algorithms);
+  make_boolean_option (c, vbox, group, OPT_PIPELINED_INSTALL,
+		       "Install while downloading",
+		       &pipelined_install);
   make_boolean_option (c, vbox, group, OPT_PERMANENT,
  		       "Red pill is permanent",
  		       &red_pill_permanent);
@@ -359,6 +371,8 @@ backend_options ()
     *ptr++ = 'D';
   if (download_packages_to_mmc)
     *ptr++ = 'M';
+  if (pipelined_install)
+    *ptr++ = 'P';
   *ptr++ = '\0';
 
   return options;
@@ -31,6 +31,7 @@ void save_settings ();
 //
 extern int    package_sort_key;
 extern int    package_sort_sign;
+extern int    archive_cache_budget;
 
 // Non-user serviceable settings, please ask your local geek.
 //
@@ -39,6 +40,7 @@ extern bool assume_connection;
 extern bool break_locks;
 extern bool download_packages_to_mmc;
 extern bool use_apt_algorithms;
+extern bool pipelined_install;
 extern bool red_pill_mode;
 extern bool red_pill_show_deps;
 extern bool red_pill_show_all;
@@ -38,6 +38,7 @@ extern "C" {
 #define UFILE_TAPPED_NOTIFICATIONS "tapped-notifications"
 #define UFILE_AVAILABLE_NOTIFICATIONS "available-notifications"
 #define UFILE_AVAILABLE_NOTIFICATIONS_TMP   UFILE_AVAILABLE_NOTIFICATIONS ".tmp"
+#define UFILE_NOTIFICATIONS_VALIDATORS      UFILE_AVAILABLE_NOTIFICATIONS ".validators"
 #define UFILE_BOOT "boot"
 #define UFILE_LAST_UPDATE "last-update"
 
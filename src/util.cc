@@ -50,6 +50,7 @@
 #include "user_files.h"
 #include "update-notifier-conf.h"
 #include "package-info-cell-renderer.h"
+#include "package-list-model.h"
 #include "confutils.h"
 
 #define _(x) gettext (x)
@@ -1061,6 +1062,9 @@ struct entertainment_data {
 
   int64_t already, total;
 
+  /* Estimated seconds remaining, or zero when unknown */
+  int eta;
+
   void (*cancel_callback) (void *);
   void *cancel_data;
   bool was_cancelled;
@@ -1133,12 +1137,28 @@ entertainment_update_title ()
 {
   if (entertainment.dialog)
     {
+      const char *title;
+
       if (entertainment.sub_title && !entertainment.strong_main_title)
-        gtk_progress_bar_set_text (GTK_PROGRESS_BAR (entertainment.bar),
-                                   entertainment.sub_title);
+        title = entertainment.sub_title;
+      else
+        title = entertainment.main_title;
+
+      if (entertainment.eta > 0 && title != NULL)
+        {
+          /* Show the remaining time as minutes:seconds after the
+             title, which doesn't need to be translated.
+          */
+          char *text = g_strdup_printf ("%s  ~%d:%02d", title,
+                                        entertainment.eta / 60,
+                                        entertainment.eta % 60);
+          gtk_progress_bar_set_text (GTK_PROGRESS_BAR (entertainment.bar),
+                                     text);
+          g_free (text);
+        }
       else
         gtk_progress_bar_set_text (GTK_PROGRESS_BAR (entertainment.bar),
-                                   entertainment.main_title);
+                                   title);
     }
 }
 
@@ -1316,6 +1336,7 @@ stop_entertaining_user ()
 
       entertainment.cancel_callback = NULL;
       entertainment.cancel_data = NULL;
+      entertainment.eta = 0;
 
       set_entertainment_games (1, &default_entertainment_game);
     }
@@ -1438,6 +1459,16 @@ set_entertainment_download_fun (int game, int64_t already, int64_t total)
   set_entertainment_fun (sub_title, game, already, total);
 }
 
+void
+set_entertainment_eta (int seconds)
+{
+  if (seconds != entertainment.eta)
+    {
+      entertainment.eta = seconds;
+      entertainment_update_title ();
+    }
+}
+
 void
 set_entertainment_cancel (void (*callback) (void *data),
 			  void *data)
@@ -1599,7 +1630,8 @@ make_small_label (const char *text)
 }
 
 static GtkTreeModelFilter *global_tree_model_filter = NULL;
-static GtkListStore *global_list_store = NULL;
+static PackageListModel *global_package_model = NULL;
+static GtkWidget *global_tree_view = NULL;
 static bool global_installed;
 
 static bool global_icons_initialized = false;
@@ -1745,6 +1777,7 @@ static void set_global_package_list (GList *packages,
 				     bool installed,
 				     package_info_callback *selected,
 				     package_info_callback *activated);
+static void make_global_package_model ();
 
 static GList *global_packages = NULL;
 
@@ -1863,34 +1896,109 @@ button_press_cb (GtkWidget *treeview, GdkEventButton *event, gpointer data)
 
 #if HILDON_CHECK_VERSION (2,2,5)
 
+/* The live search filter is called for every row on every keystroke,
+   so everything that does not depend on the query is computed once
+   per package and kept in PI->search_tokens.
+
+   The casefolded query is kept here as well, together with a serial
+   number that identifies it.  When a new query merely extends the
+   previous one, no row that was rejected by the previous query can
+   match the new one, and such rows are rejected without looking at
+   their tokens.
+*/
+
+static gchar *live_search_text = NULL;
+static gchar *live_search_folded = NULL;
+static gchar **live_search_tokens = NULL;
+static int live_search_serial = 0;
+static int live_search_narrowed_serial = 0;
+
+static void
+live_search_reset ()
+{
+  g_free (live_search_text);
+  g_free (live_search_folded);
+  g_strfreev (live_search_tokens);
+  live_search_text = NULL;
+  live_search_folded = NULL;
+  live_search_tokens = NULL;
+  live_search_narrowed_serial = 0;
+}
+
+static void
+live_search_set_query (const gchar *text)
+{
+  gchar *folded;
+
+  if (live_search_text && !strcmp (live_search_text, text))
+    return;
+
+  folded = g_utf8_casefold (text, -1);
+
+  if (live_search_folded && live_search_folded[0] != '\0'
+      && g_str_has_prefix (folded, live_search_folded))
+    live_search_narrowed_serial = live_search_serial;
+  else
+    live_search_narrowed_serial = 0;
+
+  g_free (live_search_text);
+  g_free (live_search_folded);
+  g_strfreev (live_search_tokens);
+  live_search_text = g_strdup (text);
+  live_search_folded = folded;
+  live_search_tokens = g_strsplit (folded, " ", -1);
+  live_search_serial++;
+}
+
+static void
+live_search_forget_package (package_info *pi)
+{
+  g_strfreev (pi->search_tokens);
+  pi->search_tokens = NULL;
+  pi->search_serial = 0;
+}
+
+static gchar **
+live_search_package_tokens (package_info *pi)
+{
+  if (pi->search_tokens == NULL
+      || pi->search_tokens_installed != global_installed)
+    {
+      const gchar *desc = (global_installed
+                           ? pi->installed_short_description
+                           : pi->available_short_description);
+      gchar *text = g_strconcat (pi->get_display_name (global_installed),
+                                 " ", desc, NULL);
+      gchar *folded = g_utf8_casefold (text, -1);
+
+      live_search_forget_package (pi);
+      pi->search_tokens = g_strsplit (folded, " ", -1);
+      pi->search_tokens_installed = global_installed;
+
+      g_free (folded);
+      g_free (text);
+    }
+
+  return pi->search_tokens;
+}
+
 static gboolean
 live_search_look_for_prefix (gchar **tokens, const gchar *prefix)
 {
-  gchar *needle = NULL;
-  gboolean found = false;
   gint i = 0;
 
   /* We need something to look for first of all */
   if (!tokens)
     return FALSE;
 
-  /* Casefold needle for ease of comparison */
-  needle = g_utf8_casefold (prefix, -1);
-
   /* Look through the tokens */
   for (i = 0; tokens[i] != NULL; i++)
     {
-      found = g_str_has_prefix (tokens[i], needle);
-
-      /* Don't keep on looking if already found */
-      if (found)
-        break;
+      if (g_str_has_prefix (tokens[i], prefix))
+        return TRUE;
     }
 
-  /* Free */
-  g_free (needle);
-
-  return found;
+  return FALSE;
 }
 
 static gboolean
@@ -1900,17 +2008,16 @@ live_search_filter_func (GtkTreeModel *model,
                          gpointer      data)
 {
     package_info *pi = NULL;
-    gchar *text_utf8 = NULL;
-    gchar *name = NULL;
-    gchar *desc = NULL;
-    gchar **text_tokens = NULL;
-    gchar **name_tokens = NULL;
-    gchar **desc_tokens = NULL;
+    gchar **pkg_tokens = NULL;
     gboolean retvalue = FALSE;
     GtkWidget *live = GTK_WIDGET (data);
     gint i = 0;
 
-    if (global_packages == NULL)
+    /* The live search of a view that has been dropped might still
+       filter the old model, whose packages might be gone.
+    */
+    if (global_packages == NULL
+        || model != GTK_TREE_MODEL (global_package_model))
       return FALSE;
 
     /* Get package info */
@@ -1925,41 +2032,31 @@ live_search_filter_func (GtkTreeModel *model,
         return FALSE;
       }
 
-    /* Casefold name, description and text for ease of comparison */
-    text_utf8 = g_utf8_casefold (text, -1);
-    name = g_utf8_casefold (pi->get_display_name(global_installed), -1);
-    desc = g_utf8_casefold (global_installed
-                            ? pi->installed_short_description
-                            : pi->available_short_description,
-                            -1);
-
-    /* Tokenize name and description */
-    name_tokens = g_strsplit (name, " ", -1);
-    desc_tokens = g_strsplit (desc, " ", -1);
-
-    /* Tokenize and search for *all* the tokens */
-    text_tokens = g_strsplit (text, " ", -1);
-    for (i = 0; text_tokens[i] != NULL; i++)
+    live_search_set_query (text);
+
+    /* Rows rejected by a shorter version of this query stay rejected */
+    if (live_search_narrowed_serial != 0
+        && pi->search_serial == live_search_narrowed_serial
+        && !pi->search_matched)
       {
-        /* Check package name */
-        retvalue = live_search_look_for_prefix (name_tokens, text_tokens[i]);
+        pi->search_serial = live_search_serial;
+        return FALSE;
+      }
 
-        /* Check short description if not found yet */
-        if (!retvalue)
-          retvalue = live_search_look_for_prefix (desc_tokens, text_tokens[i]);
+    /* Search for *all* the tokens of the query */
+    pkg_tokens = live_search_package_tokens (pi);
+    for (i = 0; live_search_tokens[i] != NULL; i++)
+      {
+        retvalue = live_search_look_for_prefix (pkg_tokens,
+                                                live_search_tokens[i]);
 
         /* If not found reached this point, don't keep on looking */
         if (!retvalue)
           break;
       }
 
-    /* Free */
-    g_strfreev (text_tokens);
-    g_strfreev (name_tokens);
-    g_strfreev (desc_tokens);
-    g_free (text_utf8);
-    g_free (name);
-    g_free (desc);
+    pi->search_serial = live_search_serial;
+    pi->search_matched = retvalue;
 
     return retvalue;
 }
@@ -1980,6 +2077,29 @@ tree_tap_and_hold_cb (GtkWidget *tree, gpointer data)
 }
 #endif /* TAP_AND_HOLD && MAEMO_CHANGES */
 
+/* Forget the current model.  The view that still shows it must not
+   look at packages that might go away, so it is detached from its
+   model first.  This doesn't emit a signal for every row, unlike
+   emptying the model.
+*/
+static void
+drop_global_package_model ()
+{
+  if (global_tree_view != NULL)
+    {
+      gtk_tree_view_set_model (GTK_TREE_VIEW (global_tree_view), NULL);
+      g_object_remove_weak_pointer (G_OBJECT (global_tree_view),
+                                    (gpointer *) &global_tree_view);
+      global_tree_view = NULL;
+    }
+
+  if (global_package_model != NULL)
+    {
+      g_object_unref (global_package_model);
+      global_package_model = NULL;
+    }
+}
+
 static GtkWidget *
 make_global_package_list (GtkWidget *window,
                           GList *packages,
@@ -2013,19 +2133,24 @@ make_global_package_list (GtkWidget *window,
       return label;
     }
 
-  /* Just create a new model for the first time */
-  if (global_list_store == NULL)
-    global_list_store = gtk_list_store_new (1, G_TYPE_POINTER);
+  /* Every list gets a new model, which gets all its rows before
+     anything listens to it.
+  */
+  drop_global_package_model ();
+  set_global_package_list (packages, installed, selected, activated);
+  make_global_package_model ();
 
   if (global_tree_model_filter != NULL)
     g_object_unref (global_tree_model_filter);
 
   /* Create a tree model filter with the actual model inside */
   global_tree_model_filter =
-    GTK_TREE_MODEL_FILTER (gtk_tree_model_filter_new (GTK_TREE_MODEL (global_list_store), NULL));
+    GTK_TREE_MODEL_FILTER (gtk_tree_model_filter_new (GTK_TREE_MODEL (global_package_model), NULL));
 
   /* Insert the filter into the treeview */
   tree = gtk_tree_view_new_with_model (GTK_TREE_MODEL (global_tree_model_filter));
+  global_tree_view = tree;
+  g_object_add_weak_pointer (G_OBJECT (tree), (gpointer *) &global_tree_view);
 
   column = gtk_tree_view_column_new ();
 
@@ -2101,8 +2226,6 @@ make_global_package_list (GtkWidget *window,
   gtk_widget_show_all (menu);
 #endif /* TAP_AND_HOLD && MAEMO_CHANGES */
 
-  set_global_package_list (packages, installed, selected, activated);
-
   grab_focus_on_map (tree);
 
   /* Scroll to desired cell, if needed */
@@ -2247,21 +2370,6 @@ set_global_package_list (GList *packages,
 			 package_info_callback *selected,
 			 package_info_callback *activated)
 {
-  if (global_list_store)
-    {
-      /* @FIXME:
-         Gotta set entries to NULL first, because some bug in maemo-gtk/hildon
-         is causing calls to cat_icon_func/cat_text_func with garbage data
-      */
-      GtkTreeIter itr;
-      if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (global_list_store), &itr))
-        do
-          {
-            gtk_list_store_set(global_list_store, &itr, 0, NULL, -1);
-          } while (gtk_tree_model_iter_next (GTK_TREE_MODEL (global_list_store), &itr));
-      gtk_list_store_clear (global_list_store);
-    }
-
   for (GList *p = global_packages; p; p = p->next)
     {
       package_info *pi = (package_info *)p->data;
@@ -2273,7 +2381,15 @@ set_global_package_list (GList *packages,
   global_activation_callback = activated;
   global_packages = packages;
 
-  int pos = 0;
+#if HILDON_CHECK_VERSION (2,2,5)
+  live_search_reset ();
+#endif
+}
+
+static void
+make_global_package_model ()
+{
+  GPtrArray *rows = g_ptr_array_new ();
   for (GList *p = global_packages; p; p = p->next)
     {
       package_info *pi = (package_info *)p->data;
@@ -2284,24 +2400,39 @@ set_global_package_list (GList *packages,
       if (!pi->installed_version && package_is_hidden (pi))
         continue;
 
-      pi->model = GTK_TREE_MODEL (global_list_store);
-      gtk_list_store_insert_with_values (global_list_store, &pi->iter,
-                                         pos,
-                                         0, pi,
-                                         -1);
-      pos++;
+#if HILDON_CHECK_VERSION (2,2,5)
+      live_search_package_tokens (pi);
+#endif
+
+      g_ptr_array_add (rows, pi);
+    }
+
+  global_package_model = package_list_model_new (rows);
+
+  GtkTreeModel *model = GTK_TREE_MODEL (global_package_model);
+  for (guint i = 0; i < rows->len; i++)
+    {
+      package_info *pi = (package_info *)g_ptr_array_index (rows, i);
+
+      pi->model = model;
+      gtk_tree_model_iter_nth_child (model, &pi->iter, NULL, i);
     }
 }
 
 void
 clear_global_package_list ()
 {
+  drop_global_package_model ();
   set_global_package_list (NULL, false, NULL, NULL);
 }
 
 void
 global_package_info_changed (package_info *pi)
 {
+#if HILDON_CHECK_VERSION (2,2,5)
+  live_search_forget_package (pi);
+#endif
+
   if (pi->model)
     emit_row_changed (pi->model, &pi->iter);
 }
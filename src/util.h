@@ -258,6 +258,11 @@ void install_confirm (bool scare_user, package_info *pi, bool multiple,
    set_entertainment_fun: it automatically provides an appropriate
    sub-title that includes the total download size.
 
+   SET_ENTERTAINMENT_ETA sets the estimated number of seconds until
+   the operation is done, which is shown next to the title.  Zero
+   means that no estimate is shown.  It is reset when the dialog goes
+   away.
+
    SET_ENTERTAINMENT_CANCEL associates a callback with the "Cancel"
    button in the dialog.  When CALLBACK is NULL, the button is
    insensitive.
@@ -317,6 +322,7 @@ void set_entertainment_games (int n, entertainment_game *games);
 void set_entertainment_fun (const char *sub_title,
 			    int game, int64_t alreday, int64_t total);
 void set_entertainment_download_fun (int game, int64_t already, int64_t total);
+void set_entertainment_eta (int seconds);
 
 void set_entertainment_cancel (void (*callback)(void *), void *data);
 
@@ -27,16 +27,298 @@
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "xexp.h"
 
+/** Memory
+
+    Tags are interned with g_intern_string and never freed, so nodes
+    only need to allocate their text.
+
+    Trees that are read from files or streams can be big and are
+    usually freed as a whole, so their nodes and texts are allocated
+    from an arena instead of individually.  The arena is reference
+    counted: it holds one reference for each of its nodes that is not
+    a child of another node of the same arena.  Freeing the top-level
+    node of a tree that has been read drops the last reference and
+    releases all its memory at once, without walking the tree.
+
+    Nodes from different arenas and from the heap can be mixed
+    freely.  When a node that is not from the arena becomes the child
+    of an arena node, it is put on the FOREIGN list of the arena and
+    is freed together with it.  The node remembers its link in that
+    list, so that it can be taken off again in constant time.
+
+    Like with any reference counting, cycles would not be collected:
+    when an arena node is a descendant of a foreign node of its own
+    arena, that arena would never be freed.  Such a foreign node is
+    therefore refused as a child, see can_adopt.  Nodes have no
+    parent pointers, so this is only checked when the foreign node
+    joins the arena.  Adding a node of the arena to it later on is not
+    caught, as documented in xexp.h.
+*/
+
+#define XEXP_ARENA_BLOCK_SIZE 4096
+
+typedef struct xexp_arena xexp_arena;
+
+struct xexp_arena {
+  int ref_count;
+  char *next;
+  gsize left;
+  GSList *blocks;
+  GList *foreign;
+  GSList *indexed;
+};
+
+/* LAST is the last child of a list, or NULL when it is not known.
+   INDEX maps tags to the first child with that tag and is created by
+   xexp_aref for long lists.  FOREIGN_LINK is the link of the node in
+   the FOREIGN list of the arena of its parent, if it is on it.
+*/
 struct xexp {
-  char *tag;
+  const char *tag;
   xexp *rest;
   xexp *first;
   char *text;
+  xexp_arena *arena;
+  xexp *last;
+  GHashTable *index;
+  GList *foreign_link;
 };
 
+static xexp_arena *
+xexp_arena_new ()
+{
+  xexp_arena *a = g_new0 (xexp_arena, 1);
+  a->ref_count = 1;
+  return a;
+}
+
+static void
+xexp_arena_ref (xexp_arena *a)
+{
+  a->ref_count++;
+}
+
+static void
+xexp_arena_unref (xexp_arena *a)
+{
+  GSList *l;
+  GList *f;
+
+  if (--a->ref_count > 0)
+    return;
+
+  for (f = a->foreign; f; f = f->next)
+    {
+      xexp *x = (xexp *)f->data;
+      x->rest = NULL;
+      x->foreign_link = NULL;
+      xexp_free (x);
+    }
+  g_list_free (a->foreign);
+
+  for (l = a->indexed; l; l = l->next)
+    {
+      xexp *x = (xexp *)l->data;
+      if (x->index)
+	g_hash_table_destroy (x->index);
+    }
+  g_slist_free (a->indexed);
+
+  for (l = a->blocks; l; l = l->next)
+    g_free (l->data);
+  g_slist_free (a->blocks);
+
+  g_free (a);
+}
+
+/* Take over BLOCK, which must have been allocated with g_malloc.
+ */
+static void
+xexp_arena_adopt (xexp_arena *a, void *block)
+{
+  a->blocks = g_slist_prepend (a->blocks, block);
+}
+
+static void *
+xexp_arena_alloc (xexp_arena *a, gsize size)
+{
+  void *mem;
+
+  size = (size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+  if (size > a->left)
+    {
+      gsize block_size = MAX (size, XEXP_ARENA_BLOCK_SIZE);
+      a->next = (char *) g_malloc (block_size);
+      a->left = block_size;
+      xexp_arena_adopt (a, a->next);
+    }
+
+  mem = a->next;
+  a->next += size;
+  a->left -= size;
+  return mem;
+}
+
+static char *
+xexp_arena_strndup (xexp_arena *a, const char *str, gsize len)
+{
+  char *mem = (char *) xexp_arena_alloc (a, len + 1);
+  memcpy (mem, str, len);
+  mem[len] = '\0';
+  return mem;
+}
+
+static xexp *
+xexp_arena_list_new (xexp_arena *a, const char *tag)
+{
+  xexp *x = (xexp *) xexp_arena_alloc (a, sizeof (xexp));
+  x->tag = g_intern_string (tag);
+  x->rest = x->first = x->last = NULL;
+  x->text = NULL;
+  x->arena = a;
+  x->index = NULL;
+  x->foreign_link = NULL;
+  return x;
+}
+
+/* Whether X or one of its descendants is a node of the arena A.
+ */
+static int
+contains_arena_node (xexp *x, xexp_arena *a)
+{
+  xexp *y;
+
+  if (x->arena == a)
+    return TRUE;
+  for (y = x->first; y; y = y->rest)
+    if (contains_arena_node (y, a))
+      return TRUE;
+  return FALSE;
+}
+
+/* Whether Y may become a child of X.  A node that would be foreign to
+   the arena of X must not contain nodes of that arena, since they
+   would keep the arena alive and the arena would keep the node.
+*/
+static int
+can_adopt (xexp *x, xexp *y)
+{
+  return (x->arena == NULL
+	  || y->arena == x->arena
+	  || !contains_arena_node (y, x->arena));
+}
+
+/* Y has just become a child of X.
+ */
+static void
+adopt (xexp *x, xexp *y)
+{
+  if (y->arena && y->arena == x->arena)
+    xexp_arena_unref (y->arena);
+  else if (x->arena)
+    {
+      x->arena->foreign = g_list_prepend (x->arena->foreign, y);
+      y->foreign_link = x->arena->foreign;
+    }
+}
+
+/* Y is no longer a child of X.
+ */
+static void
+disown (xexp *x, xexp *y)
+{
+  if (y->arena && y->arena == x->arena)
+    xexp_arena_ref (y->arena);
+  else if (y->foreign_link)
+    {
+      x->arena->foreign = g_list_delete_link (x->arena->foreign,
+					      y->foreign_link);
+      y->foreign_link = NULL;
+    }
+}
+
+/** Tails and indices
+
+    A list remembers its last child so that appending does not need
+    to walk it, and long lists get a hash table from tags to children
+    when they are searched with xexp_aref.  The functions below keep
+    both up to date when children are added or removed; operations
+    that reorder a list just drop the index.
+*/
+
+#define XEXP_INDEX_THRESHOLD 16
+
+static xexp *
+find_last (xexp *x)
+{
+  if (x->last == NULL && x->first)
+    {
+      xexp *y;
+      for (y = x->first; y->rest; y = y->rest)
+	;
+      x->last = y;
+    }
+  return x->last;
+}
+
+static void
+drop_index (xexp *x)
+{
+  if (x->index)
+    {
+      g_hash_table_destroy (x->index);
+      x->index = NULL;
+    }
+}
+
+static void
+build_index (xexp *x)
+{
+  xexp *y;
+
+  x->index = g_hash_table_new (g_str_hash, g_str_equal);
+  for (y = x->first; y; y = y->rest)
+    if (g_hash_table_lookup (x->index, y->tag) == NULL)
+      g_hash_table_insert (x->index, (gpointer) y->tag, y);
+
+  /* The arena needs to destroy the hash table when it is freed.
+   */
+  if (x->arena && g_slist_find (x->arena->indexed, x) == NULL)
+    x->arena->indexed = g_slist_prepend (x->arena->indexed, x);
+}
+
+/* Y has been added to X, either at the front or at the end.
+ */
+static void
+index_add (xexp *x, xexp *y)
+{
+  if (x->index
+      && (x->first == y
+	  || g_hash_table_lookup (x->index, y->tag) == NULL))
+    g_hash_table_insert (x->index, (gpointer) y->tag, y);
+}
+
+/* Y is about to be removed from X.
+ */
+static void
+index_remove (xexp *x, xexp *y)
+{
+  if (x->index && g_hash_table_lookup (x->index, y->tag) == y)
+    {
+      xexp *z = xexp_aref_rest (y, y->tag);
+      if (z)
+	g_hash_table_insert (x->index, (gpointer) y->tag, z);
+      else
+	g_hash_table_remove (x->index, y->tag);
+    }
+}
+
 xexp *
 xexp_rest (xexp *x)
 {
@@ -53,6 +335,12 @@ xexp_free (xexp *x)
 
   g_return_if_fail (x->rest == NULL);
 
+  if (x->arena)
+    {
+      xexp_arena_unref (x->arena);
+      return;
+    }
+
   xexp *c = x->first;
   while (c)
     {
@@ -61,7 +349,7 @@ xexp_free (xexp *x)
       xexp_free (c);
       c = r;
     }
-  g_free (x->tag);
+  drop_index (x);
   g_free (x->text);
   g_free (x);
 }
@@ -75,13 +363,13 @@ xexp_copy (xexp *x)
     return NULL;
 
   y = g_new0 (xexp, 1);
-  y->tag = g_strdup (x->tag);
+  y->tag = x->tag;
   y->text = g_strdup (x->text);
   
   for (z = x->first, zptr = &y->first;
        z;
        z = z->rest, zptr = &(*zptr)->rest)
-    *zptr = xexp_copy (z);
+    *zptr = y->last = xexp_copy (z);
 
   return y;
 }
@@ -95,7 +383,7 @@ xexp_tag (xexp *x)
 int
 xexp_is (xexp *x, const char *tag)
 {
-  return strcmp (x->tag, tag) == 0;
+  return x->tag == tag || strcmp (x->tag, tag) == 0;
 }
 
 int
@@ -110,7 +398,7 @@ xexp_list_new (const char *tag)
   g_assert (tag);
 
   xexp *x = g_new0 (xexp, 1);
-  x->tag = g_strdup (tag);
+  x->tag = g_intern_string (tag);
   return x;
 }
 
@@ -159,6 +447,8 @@ xexp_list_sort (xexp *x,
 
       /* Finish the list */
       x_item1->rest = NULL;
+      x->last = x_item1;
+      drop_index (x);
 
       g_slist_free (x_slist);
     }
@@ -201,6 +491,7 @@ xexp_list_filter (xexp *x, int (*xexp_filter_func) (xexp *x))
   /* Finish the list */
   if (last_inserted_item)
     last_inserted_item->rest = NULL;
+  filtered_xexp->last = last_inserted_item;
 
   return filtered_xexp;
 }
@@ -239,6 +530,7 @@ xexp_list_map (xexp *x, xexp * (*xexp_map_func) (xexp *x))
   /* Finish the list */
   if (last_inserted_item)
     last_inserted_item->rest = NULL;
+  mapped_xexp->last = last_inserted_item;
 
   return mapped_xexp;
 }
@@ -275,36 +567,65 @@ xexp_cons (xexp *x, xexp *y)
 {
   g_return_if_fail (xexp_is_list (x));
   g_return_if_fail (xexp_rest (y) == NULL);
+  g_return_if_fail (can_adopt (x, y));
+  if (x->first == NULL)
+    x->last = y;
   y->rest = x->first;
   x->first = y;
+  index_add (x, y);
+  adopt (x, y);
 }
 
 void
 xexp_append_1 (xexp *x, xexp *y)
 {
-  xexp **yptr;
+  xexp *last;
 
   g_return_if_fail (xexp_is_list (x));
   g_return_if_fail (xexp_rest (y) == NULL);
+  g_return_if_fail (can_adopt (x, y));
 
-  for (yptr = &x->first; *yptr; yptr = &(*yptr)->rest)
-    ;
-  *yptr = y;
+  last = find_last (x);
+  if (last)
+    last->rest = y;
+  else
+    x->first = y;
+  x->last = y;
+  index_add (x, y);
+  adopt (x, y);
 }
 
 void
 xexp_append (xexp *x, xexp *y)
 {
-  xexp **yptr;
+  xexp *last, *z;
 
   g_return_if_fail (xexp_is_list (x));
   g_return_if_fail (xexp_is_list (y));
   g_return_if_fail (xexp_rest (y) == NULL);
 
-  for (yptr = &x->first; *yptr; yptr = &(*yptr)->rest)
-    ;
-  *yptr = y->first;
-  y->first = NULL;
+  if (y->first == NULL)
+    {
+      xexp_free (y);
+      return;
+    }
+
+  for (z = y->first; z; z = z->rest)
+    g_return_if_fail (can_adopt (x, z));
+
+  last = find_last (x);
+  if (last)
+    last->rest = y->first;
+  else
+    x->first = y->first;
+  for (z = y->first; z; z = z->rest)
+    {
+      disown (y, z);
+      adopt (x, z);
+      index_add (x, z);
+      x->last = z;
+    }
+  y->first = y->last = NULL;
   xexp_free (y);
 }
 
@@ -317,6 +638,7 @@ xexp_reverse (xexp *x)
 
   y = x->first;
   f = NULL;
+  x->last = y;
   while (y)
     {
       xexp *r = y->rest;
@@ -325,6 +647,7 @@ xexp_reverse (xexp *x)
       y = r;
     }
   x->first = f;
+  drop_index (x);
 }
 
 void
@@ -339,8 +662,12 @@ xexp_del (xexp *x, xexp *z)
       xexp *y = *yptr;
       if (y == z)
 	{
+	  index_remove (x, y);
+	  if (y == x->last)
+	    x->last = NULL;
 	  *yptr = y->rest;
 	  y->rest = NULL;
+	  disown (x, y);
 	  xexp_free (y);
 	  return;
 	}
@@ -359,8 +686,12 @@ xexp_pop (xexp *x)
   y = x->first;
   if (y)
     {
+      index_remove (x, y);
+      if (y == x->last)
+	x->last = NULL;
       x->first = y->rest;
       y->rest = NULL;
+      disown (x, y);
     }
   return y;
 }
@@ -372,7 +703,7 @@ xexp_text_new (const char *tag, const char *text)
   g_assert (text);
 
   xexp *x = g_new0 (xexp, 1);
-  x->tag = g_strdup (tag);
+  x->tag = g_intern_string (tag);
   if (*text)
     x->text = g_strdup (text);
   return x;
@@ -385,7 +716,7 @@ xexp_text_newn (const char *tag, const char *text, int len)
   g_assert (text);
 
   xexp *x = g_new0 (xexp, 1);
-  x->tag = g_strdup (tag);
+  x->tag = g_intern_string (tag);
   if (*text)
     x->text = g_strndup (text, len);
   return x;
@@ -423,13 +754,21 @@ xexp_aref (xexp *x, const char *tag)
 {
   if (xexp_is_list (x))
     {
-      xexp *y = xexp_first (x);
-      while (y)
-	{
-	  if (xexp_is (y, tag))
-	    return y;
-	  y = xexp_rest (y);
-	}
+      int n = 0;
+      xexp *y;
+
+      if (x->index)
+	return (xexp *) g_hash_table_lookup (x->index, tag);
+
+      for (y = xexp_first (x); y; y = xexp_rest (y), n++)
+	if (xexp_is (y, tag))
+	  break;
+
+      /* This was a long search, make the next one faster.
+       */
+      if (n >= XEXP_INDEX_THRESHOLD)
+	build_index (x);
+      return y;
     }
   return NULL;
 }
@@ -512,14 +851,19 @@ xexp_adel (xexp *x, const char *tag)
   xexp **yptr;
 
   g_return_if_fail (xexp_is_list (x));
+  if (x->index)
+    g_hash_table_remove (x->index, tag);
   yptr = &x->first;
   while (*yptr)
     {
       xexp *y = *yptr;
       if (xexp_is (y, tag))
 	{
+	  if (y == x->last)
+	    x->last = NULL;
 	  *yptr = y->rest;
 	  y->rest = NULL;
+	  disown (x, y);
 	  xexp_free (y);
 	}
       else
@@ -530,7 +874,8 @@ xexp_adel (xexp *x, const char *tag)
 static void
 transmogrify_text_to_empty (xexp *x)
 {
-  g_free (x->text);
+  if (x->arena == NULL)
+    g_free (x->text);
   x->text = NULL;
 }
 
@@ -538,187 +883,885 @@ static void
 transmogrify_empty_to_text (xexp *x, const char *text)
 {
   g_assert (text && *text);
-  x->text = g_strdup (text);
+  if (x->arena)
+    x->text = xexp_arena_strndup (x->arena, text, strlen (text));
+  else
+    x->text = g_strdup (text);
 }
 
-/** Parsing */
+/** Parsing
+
+    The reader understands the subset of XML that xexp_write produces,
+    plus what a hand-written file is likely to contain: comments,
+    processing instructions, a doctype declaration, CDATA sections,
+    attributes (which are ignored), and character and the predefined
+    entity references.
+
+    It reads either from a FILE or from a buffer in memory.  A FILE
+    is read with getc, which is buffered by stdio, and the reader
+    stops right after the '>' that ends the top-level element.  The
+    rest of the stream is thus left for the caller.  A buffer holds a
+    whole file, and anything but blanks, comments and processing
+    instructions after the top-level element is an error.
+
+    Texts and tag names must be valid UTF-8.
+*/
 
 typedef struct {
-  xexp *result;
-  GSList *stack;
-} xexp_parse_context;
+  FILE *f;
+  const char *ptr, *end;
+  int line;
+  xexp_arena *arena;
+} xexp_reader;
+
+static int
+reader_getc (xexp_reader *r)
+{
+  int c;
+
+  if (r->f)
+    c = getc (r->f);
+  else
+    c = (r->ptr < r->end) ? (unsigned char) *r->ptr++ : EOF;
+
+  if (c == '\n')
+    r->line++;
+  return c;
+}
 
 static void
+parse_error (xexp_reader *r, GError **error, const char *fmt, ...)
+{
+  va_list args;
+  char *msg;
+
+  va_start (args, fmt);
+  msg = g_strdup_vprintf (fmt, args);
+  va_end (args);
+
+  g_set_error (error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
+	       "line %d: %s", r->line, msg);
+  g_free (msg);
+}
+
+static int
 ignore_text (const char *text, GError **error)
 {
   const char *p = text;
-  while (*p && isspace (*p))
+  while (*p && isspace ((unsigned char) *p))
     p++;
 
   if (*p)
-    g_set_error (error, 
-		 G_MARKUP_ERROR,
-		 G_MARKUP_ERROR_INVALID_CONTENT,
-		 "Unexpected text: %s", text);
+    {
+      g_set_error (error, 
+		   G_MARKUP_ERROR,
+		   G_MARKUP_ERROR_INVALID_CONTENT,
+		   "Unexpected text: %s", text);
+      return FALSE;
+    }
+  return TRUE;
 }
 
-static void
-xexp_parser_start_element (GMarkupParseContext *context,
-			   const gchar         *element_name,
-			   const gchar        **attribute_names,
-			   const gchar        **attribute_values,
-			   gpointer             user_data,
-			   GError             **error)
+static int
+is_name_char (int c)
+{
+  return (c != EOF && !isspace (c)
+	  && c != '>' && c != '/' && c != '=' && c != '<');
+}
+
+static int
+skip_blanks (xexp_reader *r, int c)
+{
+  while (c != EOF && isspace (c))
+    c = reader_getc (r);
+  return c;
+}
+
+/* Read a name that starts with C into NAME and return the character
+   following it.
+*/
+static int
+read_name (xexp_reader *r, int c, GString *name)
+{
+  g_string_truncate (name, 0);
+  while (is_name_char (c))
+    {
+      g_string_append_c (name, c);
+      c = reader_getc (r);
+    }
+  return c;
+}
+
+/* Fail unless STR is valid UTF-8.  The reader works on bytes, so
+   this is checked for every text and tag name it produces.
+*/
+static int
+check_utf8 (xexp_reader *r, const char *str, GError **error)
+{
+  if (!g_utf8_validate (str, -1, NULL))
+    {
+      parse_error (r, error, "Invalid UTF-8 encoded text");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Skip everything up to and including TERMINATOR.
+ */
+static int
+skip_past (xexp_reader *r, const char *terminator, GError **error)
+{
+  size_t len = strlen (terminator), n = 0;
+  char window[8];
+  int c;
+
+  g_assert (len <= sizeof (window));
+
+  while (1)
+    {
+      c = reader_getc (r);
+      if (c == EOF)
+	{
+	  parse_error (r, error, "Unexpected end of input, expected '%s'",
+		       terminator);
+	  return FALSE;
+	}
+
+      if (n == len)
+	{
+	  memmove (window, window + 1, len - 1);
+	  n--;
+	}
+      window[n++] = c;
+      if (n == len && memcmp (window, terminator, len) == 0)
+	return TRUE;
+    }
+}
+
+/* Skip a markup declaration such as <!DOCTYPE ...> after its "<!".
+   A doctype can have an internal subset in brackets, which contains
+   declarations with their own '>', and quoted strings can contain
+   anything.  The declaration ends with the first '>' outside of
+   both.
+*/
+static int
+skip_declaration (xexp_reader *r, GError **error)
+{
+  int depth = 0, quote = 0, c;
+
+  while ((c = reader_getc (r)) != EOF)
+    {
+      if (quote)
+	{
+	  if (c == quote)
+	    quote = 0;
+	}
+      else if (c == '"' || c == '\'')
+	quote = c;
+      else if (c == '[')
+	depth++;
+      else if (c == ']' && depth > 0)
+	depth--;
+      else if (c == '>' && depth == 0)
+	return TRUE;
+    }
+
+  parse_error (r, error, "Unterminated markup declaration");
+  return FALSE;
+}
+
+/* Append the character referenced by the entity that follows a '&'
+   to TEXT.
+*/
+static int
+read_entity (xexp_reader *r, GString *text, GError **error)
+{
+  char name[16];
+  int len = 0, c;
+
+  while ((c = reader_getc (r)) != ';')
+    {
+      if (c == EOF || len == sizeof (name) - 1)
+	{
+	  parse_error (r, error, "Unterminated entity reference");
+	  return FALSE;
+	}
+      name[len++] = c;
+    }
+  name[len] = '\0';
+
+  if (!strcmp (name, "lt"))
+    g_string_append_c (text, '<');
+  else if (!strcmp (name, "gt"))
+    g_string_append_c (text, '>');
+  else if (!strcmp (name, "amp"))
+    g_string_append_c (text, '&');
+  else if (!strcmp (name, "quot"))
+    g_string_append_c (text, '"');
+  else if (!strcmp (name, "apos"))
+    g_string_append_c (text, '\'');
+  else if (name[0] == '#')
+    {
+      char *end;
+      gulong code;
+
+      if (name[1] == 'x')
+	code = strtoul (name + 2, &end, 16);
+      else
+	code = strtoul (name + 1, &end, 10);
+
+      if (end == name + 1 || *end != '\0' || code == 0
+	  || !g_unichar_validate (code))
+	{
+	  parse_error (r, error, "Invalid character reference: &%s;", name);
+	  return FALSE;
+	}
+      g_string_append_unichar (text, code);
+    }
+  else
+    {
+      parse_error (r, error, "Unknown entity: &%s;", name);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Handle the text that has been read since the last tag.  If the
+   current xexp is not empty, TEXT must be all whitespace and we
+   ignore it.  Otherwise, we turn the current node into text (if it
+   is not the empty string).
+*/
+static int
+flush_text (xexp_reader *r, GSList *stack, GString *text, GError **error)
+{
+  int ok = TRUE;
+
+  if (text->len == 0)
+    return TRUE;
+
+  if (!check_utf8 (r, text->str, error))
+    return FALSE;
+
+  if (stack == NULL)
+    ok = ignore_text (text->str, error);
+  else
+    {
+      xexp *y = (xexp *)stack->data;
+      if (!xexp_is_empty (y))
+	ok = ignore_text (text->str, error);
+      else
+	transmogrify_empty_to_text (y, text->str);
+    }
+
+  g_string_truncate (text, 0);
+  return ok;
+}
+
+/* Start a new element named NAME as the last child of the current
+   one.
+*/
+static int
+push_element (xexp_reader *r, GSList **stack, const char *name,
+	      GError **error)
 {
-  xexp_parse_context *xp = (xexp_parse_context *)user_data;
+  xexp *x = xexp_arena_list_new (r->arena, name);
 
-  xexp *x = xexp_list_new (element_name);
-  if (xp->stack)
+  if (*stack)
     {
       /* If the current node is a text, it must be all whitespace and
 	 we turn it into a empty node.
       */
-      xexp *y = (xexp *)xp->stack->data;
-      if (xexp_is_text (y))
+      xexp *y = (xexp *)(*stack)->data;
+      if (xexp_is_text (y) && !xexp_is_empty (y))
 	{
-	  ignore_text (xexp_text (y), error);
+	  if (!ignore_text (xexp_text (y), error))
+	    return FALSE;
 	  transmogrify_text_to_empty (y);
 	}
 
-      xexp_cons (y, x);
+      /* Both nodes are from the same arena, so there is nothing to
+	 adopt.
+      */
+      x->rest = y->first;
+      y->first = x;
     }
-  xp->stack = g_slist_prepend (xp->stack, x);
+  *stack = g_slist_prepend (*stack, x);
+  return TRUE;
 }
 
-static void
-xexp_parser_end_element (GMarkupParseContext *context,
-			 const gchar         *element_name,
-			 gpointer             user_data,
-			 GError             **error)
+/* Finish the current element and return it when it is the
+   top-level one.
+*/
+static xexp *
+pop_element (GSList **stack)
 {
-  xexp_parse_context *xp = (xexp_parse_context *)user_data;
-
-  GSList *top = xp->stack;
+  GSList *top = *stack;
   xexp *x = (xexp *)top->data;
-  xp->stack = top->next;
+  *stack = top->next;
   g_slist_free_1 (top);
 
   if (xexp_is_list (x))
     xexp_reverse (x);
 
-  if (xp->stack == NULL)
-    xp->result = x;
+  return *stack == NULL ? x : NULL;
 }
 
-static void
-xexp_parser_text (GMarkupParseContext *context,
-		  const gchar         *text,
-		  gsize                text_len,
-		  gpointer             user_data,
-		  GError             **error)
+/* Read the rest of a start tag after its name, up to and including
+   the closing '>'.  Attributes are skipped.  Returns -1 on error,
+   otherwise whether the element was empty, as in <TAG/>.
+*/
+static int
+read_start_tag_rest (xexp_reader *r, int c, GString *name, GError **error)
 {
-  xexp_parse_context *xp = (xexp_parse_context *)user_data;
+  while (1)
+    {
+      c = skip_blanks (r, c);
+      if (c == '>')
+	return FALSE;
+      else if (c == '/')
+	{
+	  if (reader_getc (r) != '>')
+	    break;
+	  return TRUE;
+	}
+      else if (is_name_char (c))
+	{
+	  int quote;
+
+	  c = skip_blanks (r, read_name (r, c, name));
+	  if (c != '=')
+	    break;
+	  quote = skip_blanks (r, reader_getc (r));
+	  if (quote != '"' && quote != '\'')
+	    break;
+	  while ((c = reader_getc (r)) != quote)
+	    if (c == EOF)
+	      break;
+	  c = reader_getc (r);
+	}
+      else
+	break;
+    }
+
+  parse_error (r, error, "Malformed start tag");
+  return -1;
+}
 
-  /* If the current xexp is not empty, TEXT must be all whitespace and
-     we ignore it.  Otherwise, we turn the current node into text (if
-     it is not the empty string).
+static xexp *
+xexp_read_1 (xexp_reader *r, GError **error)
+{
+  GSList *stack = NULL;
+  xexp *result = NULL;
+  GString *text = g_string_new (NULL);
+  GString *name = g_string_new (NULL);
+  int c;
+
+  /* The reference of the new arena belongs to the top-level node,
+     or is dropped again on failure.
   */
-  
-  if (xp->stack)
+  r->arena = xexp_arena_new ();
+  c = reader_getc (r);
+
+  while (result == NULL)
     {
-      xexp *y = (xexp *)xp->stack->data;
-      if (!xexp_is_empty (y))
-	ignore_text (text, error);
-      else if (text && *text)
-	transmogrify_empty_to_text (y, text);
+      if (c == EOF)
+	{
+	  if (stack)
+	    parse_error (r, error, "Unexpected end of input inside <%s>",
+			 xexp_tag ((xexp *)stack->data));
+	  else
+	    parse_error (r, error,
+			 "Document was empty or contained only whitespace");
+	  goto fail;
+	}
+
+      if (c != '<')
+	{
+	  if (c != '&')
+	    g_string_append_c (text, c);
+	  else if (!read_entity (r, text, error))
+	    goto fail;
+	  c = reader_getc (r);
+	  continue;
+	}
+
+      c = reader_getc (r);
+
+      if (c == '?')
+	{
+	  if (!skip_past (r, "?>", error))
+	    goto fail;
+	}
+      else if (c == '!')
+	{
+	  c = reader_getc (r);
+	  if (c == '-')
+	    {
+	      if (reader_getc (r) != '-')
+		{
+		  parse_error (r, error, "Malformed comment");
+		  goto fail;
+		}
+	      if (!skip_past (r, "-->", error))
+		goto fail;
+	    }
+	  else if (c == '[')
+	    {
+	      int brackets = 0;
+
+	      if (!skip_past (r, "CDATA[", error))
+		goto fail;
+
+	      /* The content is taken literally up to the closing ]]>.
+	       */
+	      while ((c = reader_getc (r)) != '>' || brackets < 2)
+		{
+		  if (c == EOF)
+		    {
+		      parse_error (r, error, "Unterminated CDATA section");
+		      goto fail;
+		    }
+		  brackets = (c == ']') ? brackets + 1 : 0;
+		  g_string_append_c (text, c);
+		}
+	      g_string_truncate (text, text->len - 2);
+	    }
+	  else if (!skip_declaration (r, error))
+	    goto fail;
+	}
+      else if (c == '/')
+	{
+	  if (!flush_text (r, stack, text, error))
+	    goto fail;
+
+	  c = skip_blanks (r, read_name (r, reader_getc (r), name));
+	  if (c != '>')
+	    {
+	      parse_error (r, error, "Malformed end tag </%s", name->str);
+	      goto fail;
+	    }
+	  if (stack == NULL
+	      || strcmp (xexp_tag ((xexp *)stack->data), name->str) != 0)
+	    {
+	      parse_error (r, error, "Unexpected end tag </%s>", name->str);
+	      goto fail;
+	    }
+
+	  /* Don't read beyond the end of the top-level element.
+	   */
+	  result = pop_element (&stack);
+	  if (result)
+	    break;
+	}
+      else
+	{
+	  int empty;
+
+	  if (!flush_text (r, stack, text, error))
+	    goto fail;
+
+	  c = read_name (r, c, name);
+	  if (name->len == 0)
+	    {
+	      parse_error (r, error, "Malformed start tag");
+	      goto fail;
+	    }
+	  if (!check_utf8 (r, name->str, error)
+	      || !push_element (r, &stack, name->str, error))
+	    goto fail;
+
+	  empty = read_start_tag_rest (r, c, name, error);
+	  if (empty < 0)
+	    goto fail;
+	  if (empty)
+	    {
+	      /* Don't read beyond the end of the top-level element.
+	       */
+	      result = pop_element (&stack);
+	      if (result)
+		break;
+	    }
+	}
+
+      c = reader_getc (r);
     }
+
+  g_string_free (text, TRUE);
+  g_string_free (name, TRUE);
+  return result;
+
+ fail:
+  g_slist_free (stack);
+  xexp_arena_unref (r->arena);
+  g_string_free (text, TRUE);
+  g_string_free (name, TRUE);
+  return NULL;
 }
 
-static GMarkupParser xexp_markup_parser = {
-  xexp_parser_start_element,
-  xexp_parser_end_element,
-  xexp_parser_text,
-  NULL,
-  NULL
+/* Check that only blanks, comments and processing instructions
+   follow the top-level element.
+*/
+static int
+xexp_read_end (xexp_reader *r, GError **error)
+{
+  int c;
+
+  while ((c = skip_blanks (r, reader_getc (r))) != EOF)
+    {
+      if (c == '<')
+	{
+	  c = reader_getc (r);
+	  if (c == '?')
+	    {
+	      if (!skip_past (r, "?>", error))
+		return FALSE;
+	      continue;
+	    }
+	  if (c == '!' && reader_getc (r) == '-' && reader_getc (r) == '-')
+	    {
+	      if (!skip_past (r, "-->", error))
+		return FALSE;
+	      continue;
+	    }
+	}
+
+      parse_error (r, error, "Unexpected content after the document");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/** Binary format
+
+    A binary xexp file starts with a header: the eight bytes of
+    XEXP_BINARY_MAGIC followed by a 32 bit byte order mark, and the 32
+    bit size of the tag dictionary.  The dictionary holds each
+    distinct tag once as a NUL terminated string.  After it comes the
+    top-level node.
+
+    A node is three 32 bit words: the offset of its tag relative to
+    the node itself, the size of the whole node in bytes, and flags.
+    A text node is followed by its NUL terminated text, a list node
+    by its children.  Nodes are padded to multiples of four bytes, so
+    the next sibling of a node is simply SIZE bytes further, if the
+    XEXP_NODE_HAS_REST flag says that there is one.
+
+    Everything is in native byte order; the files are not meant to be
+    moved between machines.
+*/
+
+#define XEXP_BINARY_MAGIC       "XEXPBIN\001"
+#define XEXP_BINARY_BYTE_ORDER  0x01020304
+#define XEXP_BINARY_HEADER_SIZE 16
+
+#define XEXP_NODE_IS_TEXT  1
+#define XEXP_NODE_HAS_REST 2
+
+struct xexp_node {
+  gint32 tag_offset;
+  guint32 size;
+  guint32 flags;
 };
 
-static xexp *
-xexp_read_1 (FILE *f, GError **error, int fuzzy)
+struct xexp_map {
+  void *start;
+  gsize length;
+  const xexp_node *root;
+};
+
+#define ALIGN4(n) (((n) + 3) & ~(gsize)3)
+
+static int
+is_binary_xexp (const char *data, gsize length)
 {
-  xexp_parse_context xp;
-  GMarkupParseContext *ctxt;
-  gchar buf[1024];
-  size_t buf_size = fuzzy? sizeof (buf) : 1;
-  size_t n;
-  gboolean parse_failed = FALSE;
+  return (length >= XEXP_BINARY_HEADER_SIZE
+	  && memcmp (data, XEXP_BINARY_MAGIC, 8) == 0);
+}
 
-  if (f == NULL)
+/* Check that the node at OFFSET and all its children are within
+   the LENGTH bytes at DATA and have their tags in the dictionary,
+   which ends at DICT_END.
+*/
+static int
+check_binary_node (const char *data, gsize length, gsize dict_end,
+		   gsize offset, int level)
+{
+  const xexp_node *n;
+  gsize tag, end;
+
+  if (level > 1000
+      || offset % 4 != 0
+      || offset > length
+      || length - offset < sizeof (xexp_node))
+    return FALSE;
+
+  n = (const xexp_node *)(data + offset);
+  end = offset + n->size;
+  if (n->size < sizeof (xexp_node) || n->size % 4 != 0 || end > length)
+    return FALSE;
+
+  tag = offset + n->tag_offset;
+  if (tag < XEXP_BINARY_HEADER_SIZE || tag >= dict_end
+      || memchr (data + tag, '\0', dict_end - tag) == NULL)
+    return FALSE;
+
+  if (n->flags & XEXP_NODE_IS_TEXT)
+    return memchr (n + 1, '\0', n->size - sizeof (xexp_node)) != NULL;
+
+  offset += sizeof (xexp_node);
+  while (offset < end)
+    {
+      const xexp_node *c = (const xexp_node *)(data + offset);
+
+      if (!check_binary_node (data, end, dict_end, offset, level + 1))
+	return FALSE;
+      offset += c->size;
+      if (!(c->flags & XEXP_NODE_HAS_REST))
+	break;
+
+      /* The last child must not claim a next sibling.
+       */
+      if (offset == end)
+	return FALSE;
+    }
+  return offset == end;
+}
+
+static const xexp_node *
+check_binary_xexp (const char *data, gsize length, GError **error)
+{
+  guint32 byte_order, dict_size;
+  gsize dict_end;
+
+  memcpy (&byte_order, data + 8, 4);
+  memcpy (&dict_size, data + 12, 4);
+  dict_end = XEXP_BINARY_HEADER_SIZE + (gsize) dict_size;
+
+  if (byte_order != XEXP_BINARY_BYTE_ORDER
+      || dict_end > length
+      || !check_binary_node (data, length, dict_end, ALIGN4 (dict_end), 0)
+      || (((const xexp_node *)(data + ALIGN4 (dict_end)))->flags
+	  & XEXP_NODE_HAS_REST))
+    {
+      g_set_error (error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
+		   "Corrupted binary xexp");
+      return NULL;
+    }
+
+  return (const xexp_node *)(data + ALIGN4 (dict_end));
+}
+
+const char *
+xexp_node_tag (const xexp_node *n)
+{
+  return (const char *)n + n->tag_offset;
+}
+
+int
+xexp_node_is (const xexp_node *n, const char *tag)
+{
+  return strcmp (xexp_node_tag (n), tag) == 0;
+}
+
+int
+xexp_node_is_text (const xexp_node *n)
+{
+  return (n->flags & XEXP_NODE_IS_TEXT) || n->size == sizeof (xexp_node);
+}
+
+int
+xexp_node_is_list (const xexp_node *n)
+{
+  return !(n->flags & XEXP_NODE_IS_TEXT);
+}
+
+const char *
+xexp_node_text (const xexp_node *n)
+{
+  if (n->flags & XEXP_NODE_IS_TEXT)
+    return (const char *)(n + 1);
+  else
+    return "";
+}
+
+const xexp_node *
+xexp_node_first (const xexp_node *n)
+{
+  if ((n->flags & XEXP_NODE_IS_TEXT) || n->size == sizeof (xexp_node))
     return NULL;
+  return n + 1;
+}
 
-  xp.stack = NULL;
-  xp.result = NULL;
-  ctxt = g_markup_parse_context_new (&xexp_markup_parser, 0, &xp, NULL);
+const xexp_node *
+xexp_node_rest (const xexp_node *n)
+{
+  if (n->flags & XEXP_NODE_HAS_REST)
+    return (const xexp_node *)((const char *)n + n->size);
+  return NULL;
+}
+
+const xexp_node *
+xexp_node_aref (const xexp_node *n, const char *tag)
+{
+  const xexp_node *c;
 
-  while (xp.result == NULL && (n = fread (buf, 1, buf_size, f)) > 0)
+  for (c = xexp_node_first (n); c; c = xexp_node_rest (c))
+    if (xexp_node_is (c, tag))
+      return c;
+  return NULL;
+}
+
+const char *
+xexp_node_aref_text (const xexp_node *n, const char *tag)
+{
+  const xexp_node *c = xexp_node_aref (n, tag);
+  if (c && xexp_node_is_text (c))
+    return xexp_node_text (c);
+  return NULL;
+}
+
+xexp_map *
+xexp_map_file (const char *filename)
+{
+  struct stat buf;
+  xexp_map *m;
+  void *start;
+  int fd;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &buf) < 0
+      || buf.st_size < XEXP_BINARY_HEADER_SIZE)
     {
-      if (!g_markup_parse_context_parse (ctxt, buf, n, error))
-	{
-	  parse_failed = TRUE;
-	  break;
-	}
+      close (fd);
+      return NULL;
     }
 
-  if (!g_markup_parse_context_end_parse (ctxt, error))
-    parse_failed = TRUE;
+  start = mmap (NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (start == MAP_FAILED)
+    return NULL;
 
-  g_markup_parse_context_free (ctxt);
+  m = g_new0 (xexp_map, 1);
+  m->start = start;
+  m->length = buf.st_size;
 
-  if (!parse_failed)
+  if (is_binary_xexp ((const char *)start, m->length))
     {
-      g_assert (xp.result && xp.stack == NULL);
-      return xp.result;
+      GError *error = NULL;
+      m->root = check_binary_xexp ((const char *)start, m->length, &error);
+      if (error)
+	{
+	  fprintf (stderr, "%s: %s\n", filename, error->message);
+	  g_error_free (error);
+	}
     }
 
-  /* An error while parsing has ocurred */
-  if (xp.stack)
+  if (m->root == NULL)
     {
-      xexp *top = (xexp *) g_slist_last (xp.stack)->data;
-      xexp_free (top);
-      g_slist_free (xp.stack);
+      xexp_unmap (m);
+      return NULL;
     }
-  else if (xp.result)
-    xexp_free (xp.result);
+  return m;
+}
 
-  return NULL;
+const xexp_node *
+xexp_map_root (xexp_map *m)
+{
+  return m->root;
+}
+
+void
+xexp_unmap (xexp_map *m)
+{
+  if (m == NULL)
+    return;
+
+  munmap (m->start, m->length);
+  g_free (m);
+}
+
+/* Build a xexp for N in the arena A.  The arena must own the memory
+   of N, since tags and texts are not copied.
+*/
+static xexp *
+xexp_from_node (xexp_arena *a, const xexp_node *n)
+{
+  const xexp_node *c;
+  xexp *x, **xptr;
+
+  x = xexp_arena_list_new (a, xexp_node_tag (n));
+  if (n->flags & XEXP_NODE_IS_TEXT)
+    {
+      if (*xexp_node_text (n))
+	x->text = (char *) xexp_node_text (n);
+      return x;
+    }
+
+  for (c = xexp_node_first (n), xptr = &x->first;
+       c;
+       c = xexp_node_rest (c), xptr = &(*xptr)->rest)
+    *xptr = x->last = xexp_from_node (a, c);
+  return x;
 }
 
 xexp *
 xexp_read (FILE *f, GError **error)
 {
+  xexp_reader r = { f, NULL, NULL, 1, NULL };
+
   if (f == NULL)
     return NULL;
   else
-    return xexp_read_1 (f, error, FALSE);
+    return xexp_read_1 (&r, error);
 }
 
 xexp *
 xexp_read_file (const char *filename)
 {
-  FILE *f = fopen (filename, "r");
-  if (f != NULL)
+  GError *error = NULL;
+  gchar *contents;
+  gsize length;
+  xexp *x = NULL;
+
+  /* The whole file is read with one call and parsed from memory.
+   */
+  if (g_file_get_contents (filename, &contents, &length, &error))
     {
-      GError *error = NULL;
-      xexp *x = xexp_read_1 (f, &error, TRUE);
-      fclose (f);
-      if (error)
+      if (is_binary_xexp (contents, length))
 	{
-	  fprintf (stderr, "%s: %s\n", filename, error->message);
-	  g_error_free (error);
+	  const xexp_node *root = check_binary_xexp (contents, length,
+						     &error);
+	  if (root)
+	    {
+	      xexp_arena *a = xexp_arena_new ();
+	      xexp_arena_adopt (a, contents);
+	      x = xexp_from_node (a, root);
+	      contents = NULL;
+	    }
 	}
-      return x;
+      else
+	{
+	  xexp_reader r = { NULL, contents, contents + length, 1, NULL };
+	  x = xexp_read_1 (&r, &error);
+	  if (x && !xexp_read_end (&r, &error))
+	    {
+	      xexp_free (x);
+	      x = NULL;
+	    }
+	}
+      g_free (contents);
     }
-  fprintf (stderr, "%s: %s\n", filename, strerror (errno));
-  return NULL;
+
+  if (error)
+    {
+      fprintf (stderr, "%s: %s\n", filename, error->message);
+      g_error_free (error);
+    }
+  return x;
 }
 
 /** Writing */
@@ -783,8 +1826,9 @@ xexp_write (FILE *f, xexp *x)
     xexp_write_1 (f, x, 0);
 }
 
-int
-xexp_write_file (const char *filename, xexp *x)
+static int
+write_file_atomically (const char *filename, xexp *x,
+		       void (*writer) (FILE *f, xexp *x))
 {
   char *tmp_filename = g_strdup_printf ("%s#%d", filename, getpid());
   FILE *f = fopen (tmp_filename, "w");
@@ -792,7 +1836,7 @@ xexp_write_file (const char *filename, xexp *x)
   if (f == NULL)
     goto error;
 
-  xexp_write (f, x);
+  writer (f, x);
 
   if ((ferror (f) | fflush (f) | fsync (fileno (f)) | fclose (f))
       || (rename (tmp_filename, filename) < 0))
@@ -812,3 +1856,111 @@ xexp_write_file (const char *filename, xexp *x)
     g_free (tmp_filename);
   return 0;
 }
+
+int
+xexp_write_file (const char *filename, xexp *x)
+{
+  return write_file_atomically (filename, x, xexp_write);
+}
+
+typedef struct {
+  GByteArray *buf;
+  GHashTable *tags;
+} binary_writer;
+
+static void
+pad4 (GByteArray *buf)
+{
+  static const guint8 zeros[4] = { 0, 0, 0, 0 };
+  g_byte_array_append (buf, zeros, ALIGN4 (buf->len) - buf->len);
+}
+
+static void
+collect_tags (binary_writer *w, xexp *x)
+{
+  xexp *y;
+
+  if (g_hash_table_lookup (w->tags, x->tag) == NULL)
+    {
+      g_hash_table_insert (w->tags, (gpointer) x->tag,
+			   GSIZE_TO_POINTER (w->buf->len));
+      g_byte_array_append (w->buf, (guint8 *) x->tag, strlen (x->tag) + 1);
+    }
+
+  if (x->text == NULL)
+    for (y = x->first; y; y = y->rest)
+      collect_tags (w, y);
+}
+
+static void
+write_binary_node (binary_writer *w, xexp *x)
+{
+  gsize offset = w->buf->len;
+  gsize tag = GPOINTER_TO_SIZE (g_hash_table_lookup (w->tags, x->tag));
+  xexp_node n;
+  xexp *y;
+
+  n.tag_offset = (gint32) tag - (gint32) offset;
+  n.size = 0;
+  n.flags = ((x->text ? XEXP_NODE_IS_TEXT : 0)
+	     | (x->rest ? XEXP_NODE_HAS_REST : 0));
+  g_byte_array_append (w->buf, (guint8 *) &n, sizeof (n));
+
+  if (x->text)
+    {
+      g_byte_array_append (w->buf, (guint8 *) x->text, strlen (x->text) + 1);
+      pad4 (w->buf);
+    }
+  else
+    for (y = x->first; y; y = y->rest)
+      write_binary_node (w, y);
+
+  /* The size is only known now.
+   */
+  n.size = w->buf->len - offset;
+  memcpy (w->buf->data + offset, &n, sizeof (n));
+}
+
+static void
+xexp_write_binary (FILE *f, xexp *x)
+{
+  binary_writer w;
+  guint32 word;
+  xexp *rest;
+
+  w.buf = g_byte_array_new ();
+  w.tags = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  g_byte_array_append (w.buf, (guint8 *) XEXP_BINARY_MAGIC, 8);
+  word = XEXP_BINARY_BYTE_ORDER;
+  g_byte_array_append (w.buf, (guint8 *) &word, 4);
+  word = 0;
+  g_byte_array_append (w.buf, (guint8 *) &word, 4);
+
+  /* The dictionary starts after the header, so no tag has offset
+     zero and NULL can mean "not yet in the dictionary".
+  */
+  collect_tags (&w, x);
+  word = w.buf->len - XEXP_BINARY_HEADER_SIZE;
+  memcpy (w.buf->data + 12, &word, 4);
+  pad4 (w.buf);
+
+  /* The top-level node has no siblings, even when X is part of a
+     list.
+  */
+  rest = x->rest;
+  x->rest = NULL;
+  write_binary_node (&w, x);
+  x->rest = rest;
+
+  fwrite (w.buf->data, 1, w.buf->len, f);
+
+  g_hash_table_destroy (w.tags);
+  g_byte_array_free (w.buf, TRUE);
+}
+
+int
+xexp_write_binary_file (const char *filename, xexp *x)
+{
+  return write_file_atomically (filename, x, xexp_write_binary);
+}
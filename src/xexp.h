@@ -82,6 +82,19 @@
    xexp.  (Yes, I can see already that I will add reference counting
    eventually, and then a tracing GC...)
 
+   Behind the scenes, the nodes of a tree that is read with xexp_read
+   or xexp_read_file are allocated together, and freeing the whole
+   tree is cheap.  Parts of such a tree can still be taken out of it
+   and put into other xexps; the memory is released when the last of
+   them is freed.
+
+   One thing must be avoided: a node taken out of such a tree must
+   not be put back under a node that was not read with it, but has
+   itself been put into that tree.  The memory of the tree is then
+   never released.  Putting such a node into the tree is refused
+   when it already contains nodes of the tree, but adding to it
+   afterwards is not checked.
+
    The following reference states the pre-conditions for some
    functions.  When these conditions are not fulfilled, the
    implementation will generally emit a warning and then do something
@@ -182,7 +195,8 @@
    - void xexp_append_1 (xexp *X, xexp *Y)
 
    Append Y to the end of the list of children of X.  X must be a list
-   xexp.  Y must be a free standing xexp.
+   xexp.  Y must be a free standing xexp.  X remembers its last child,
+   so building a list with xexp_append_1 takes linear time.
 
    - void xexp_append (xexp *X, xexp *Y)
 
@@ -234,7 +248,9 @@
    - xexp *xexp_aref (xexp *X, const char *TAG)
 
    Return the first xexp that has tag TAG from the children of X.
-   Return NULL if there is no such xexp.
+   Return NULL if there is no such xexp.  Long lists are indexed by
+   tag the first time they are searched, and later lookups take
+   constant time.
 
    - xexp *xexp_aref_rest (xexp *X, const char *TAG)
 
@@ -305,6 +321,46 @@
    Write X to the file named FILENAME.  When the file can not be
    written, the error is logged to stderr, the old version of it is
    left in place and false is returned.  Otherwise, true is returned.
+
+   - int xexp_write_binary_file (const char *FILENAME, xexp *X)
+
+   Like xexp_write_file, but use the compact binary format instead of
+   XML.  Binary files are much faster to load and can be mapped into
+   memory directly, but they can not be edited by hand and are in
+   native byte order.  xexp_read_file recognizes them automatically.
+
+
+   MAPPED BINARY FILES
+
+   A file written by xexp_write_binary_file can be used without
+   building a xexp for it, by mapping it into memory.  The nodes of a
+   mapped file are read-only and are valid until it is unmapped.
+
+   - xexp_map *xexp_map_file (const char *FILENAME)
+
+   Map the file named FILENAME.  NULL is returned when it can not be
+   opened or is not a valid binary xexp file; XML files are not
+   accepted.
+
+   - void xexp_unmap (xexp_map *M)
+
+   Unmap M and free it.
+
+   - const xexp_node *xexp_map_root (xexp_map *M)
+
+   Return the top-level node of M.
+
+   - const char *xexp_node_tag (const xexp_node *N)
+   - int xexp_node_is (const xexp_node *N, const char *TAG)
+   - int xexp_node_is_list (const xexp_node *N)
+   - int xexp_node_is_text (const xexp_node *N)
+   - const char *xexp_node_text (const xexp_node *N)
+   - const xexp_node *xexp_node_first (const xexp_node *N)
+   - const xexp_node *xexp_node_rest (const xexp_node *N)
+   - const xexp_node *xexp_node_aref (const xexp_node *N, const char *TAG)
+   - const char *xexp_node_aref_text (const xexp_node *N, const char *TAG)
+
+   These work like their xexp counterparts.
 */
 
 #ifndef XEXP_H
@@ -369,5 +425,27 @@ void xexp_write (FILE *f, xexp *x);
 
 xexp *xexp_read_file (const char *filename);
 int xexp_write_file (const char *filename, xexp *x);
+int xexp_write_binary_file (const char *filename, xexp *x);
+
+/* Mapped binary files
+ */
+struct xexp_map;
+typedef struct xexp_map xexp_map;
+struct xexp_node;
+typedef struct xexp_node xexp_node;
+
+xexp_map *xexp_map_file (const char *filename);
+void xexp_unmap (xexp_map *m);
+const xexp_node *xexp_map_root (xexp_map *m);
+
+const char *xexp_node_tag (const xexp_node *n);
+int xexp_node_is (const xexp_node *n, const char *tag);
+int xexp_node_is_list (const xexp_node *n);
+int xexp_node_is_text (const xexp_node *n);
+const char *xexp_node_text (const xexp_node *n);
+const xexp_node *xexp_node_first (const xexp_node *n);
+const xexp_node *xexp_node_rest (const xexp_node *n);
+const xexp_node *xexp_node_aref (const xexp_node *n, const char *tag);
+const char *xexp_node_aref_text (const xexp_node *n, const char *tag);
 
 #endif
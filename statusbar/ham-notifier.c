@@ -426,24 +426,160 @@ get_uri ()
   return uri;
 }
 
+/* Conditional downloads
+
+   The notifications document rarely changes, so we remember the
+   ETag and Last-Modified headers of the last download, together with
+   the URI they belong to, in UFILE_NOTIFICATIONS_VALIDATORS.  They
+   are sent back as If-None-Match and If-Modified-Since, and when the
+   server answers with 304 Not Modified, the document we already have
+   is left alone.
+*/
+
+typedef struct {
+  gchar *etag;
+  gchar *last_modified;
+} Validators;
+
+static void
+validators_clear (Validators *v)
+{
+  g_free (v->etag);
+  g_free (v->last_modified);
+  v->etag = v->last_modified = NULL;
+}
+
+/* Return the value of the header LINE of length LEN if its name is
+   NAME, otherwise NULL.
+*/
+static gchar *
+header_value (const char *line, size_t len, const char *name)
+{
+  size_t name_len = strlen (name);
+
+  if (len <= name_len || line[name_len] != ':'
+      || g_ascii_strncasecmp (line, name, name_len) != 0)
+    return NULL;
+
+  return g_strstrip (g_strndup (line + name_len + 1, len - name_len - 1));
+}
+
+static size_t
+collect_validators (void *ptr, size_t size, size_t nmemb, void *data)
+{
+  Validators *v = (Validators *) data;
+  const char *line = (const char *) ptr;
+  size_t len = size * nmemb;
+  gchar *value;
+
+  /* Only the headers of the last response count when we are
+     redirected.
+  */
+  if (len > 5 && strncmp (line, "HTTP/", 5) == 0)
+    validators_clear (v);
+  else if ((value = header_value (line, len, "ETag")) != NULL)
+    {
+      g_free (v->etag);
+      v->etag = value;
+    }
+  else if ((value = header_value (line, len, "Last-Modified")) != NULL)
+    {
+      g_free (v->last_modified);
+      v->last_modified = value;
+    }
+
+  return len;
+}
+
+/* Read the validators for URI, if we still have the document they
+   validate.
+*/
+static void
+read_validators (const gchar *uri, Validators *v)
+{
+  FILE *f;
+  xexp *x;
+
+  f = user_file_open_for_read (UFILE_AVAILABLE_NOTIFICATIONS);
+  if (f == NULL)
+    return;
+  fclose (f);
+
+  x = user_file_read_xexp (UFILE_NOTIFICATIONS_VALIDATORS);
+  if (x == NULL)
+    return;
+
+  if (xexp_is_list (x) && g_strcmp0 (xexp_aref_text (x, "uri"), uri) == 0)
+    {
+      v->etag = g_strdup (xexp_aref_text (x, "etag"));
+      v->last_modified = g_strdup (xexp_aref_text (x, "last-modified"));
+    }
+
+  xexp_free (x);
+}
+
+static void
+write_validators (const gchar *uri, Validators *v)
+{
+  xexp *x;
+
+  if (v->etag == NULL && v->last_modified == NULL)
+    {
+      user_file_remove (UFILE_NOTIFICATIONS_VALIDATORS);
+      return;
+    }
+
+  x = xexp_list_new ("validators");
+  xexp_aset_text (x, "uri", uri);
+  xexp_aset_text (x, "etag", v->etag);
+  xexp_aset_text (x, "last-modified", v->last_modified);
+  user_file_write_xexp (UFILE_NOTIFICATIONS_VALIDATORS, x);
+  xexp_free (x);
+}
+
 static gboolean
 download_notifications (gchar *proxy)
 {
   gchar *uri;
   FILE *tmpfile;
   CURL *handle;
+  struct curl_slist *headers;
+  Validators old_validators = { NULL, NULL };
+  Validators new_validators = { NULL, NULL };
   gboolean ok;
 
   handle = NULL;
+  headers = NULL;
+  tmpfile = NULL;
   ok = FALSE;
 
   uri = get_uri ();
   LOG ("notification uri = %s", uri);
 
+  if (uri == NULL)
+    goto exit;
+
+  read_validators (uri, &old_validators);
+
+  if (old_validators.etag != NULL)
+    {
+      gchar *h = g_strdup_printf ("If-None-Match: %s", old_validators.etag);
+      headers = curl_slist_append (headers, h);
+      g_free (h);
+    }
+
+  if (old_validators.last_modified != NULL)
+    {
+      gchar *h = g_strdup_printf ("If-Modified-Since: %s",
+                                  old_validators.last_modified);
+      headers = curl_slist_append (headers, h);
+      g_free (h);
+    }
+
   tmpfile = user_file_open_for_write (UFILE_AVAILABLE_NOTIFICATIONS_TMP);
   LOG ("tmpfile %s", tmpfile != NULL ? "ok" : "failed!!!");
 
-  if (uri != NULL && tmpfile != NULL)
+  if (tmpfile != NULL)
   {
     CURLcode ret;
     xexp *data;
@@ -455,6 +591,12 @@ download_notifications (gchar *proxy)
 
     ret = curl_easy_setopt (handle, CURLOPT_WRITEDATA, tmpfile);
     ret |= curl_easy_setopt (handle, CURLOPT_URL, uri);
+    ret |= curl_easy_setopt (handle, CURLOPT_HEADERFUNCTION,
+                             collect_validators);
+    ret |= curl_easy_setopt (handle, CURLOPT_HEADERDATA, &new_validators);
+
+    if (headers != NULL)
+      ret |= curl_easy_setopt (handle, CURLOPT_HTTPHEADER, headers);
 
     if (proxy != NULL)
       ret |= curl_easy_setopt (handle, CURLOPT_PROXY, proxy);
@@ -467,11 +609,19 @@ download_notifications (gchar *proxy)
     ret |= curl_easy_getinfo (handle, CURLINFO_RESPONSE_CODE, &response);
 
     LOG ("ret = %d, response = %ld", ret, response);
+
+    if (ret == CURLE_OK && response == 304)
+      {
+        /* What we have is still current.
+         */
+        ok = TRUE;
+        goto exit;
+      }
+
     if (ret != CURLE_OK || response != 200)
       goto exit;
 
     fflush (tmpfile);
-    fsync (fileno (tmpfile));
     fclose (tmpfile);
     tmpfile = NULL;
 
@@ -483,24 +633,31 @@ download_notifications (gchar *proxy)
       {
         /* Copy data to the final file if validated */
         user_file_write_xexp (UFILE_AVAILABLE_NOTIFICATIONS, data);
-        xexp_free (data);
+        write_validators (uri, &new_validators);
         ok = TRUE;
       }
+
+    if (data != NULL)
+      xexp_free (data);
   }
 
  exit:
   if (handle != NULL)
     curl_easy_cleanup (handle);
 
+  if (headers != NULL)
+    curl_slist_free_all (headers);
+
+  /* The temporary file is removed right away, so there is no point
+     in syncing it.
+  */
   if (tmpfile != NULL)
-    {
-      fflush (tmpfile);
-      fsync (fileno (tmpfile));
-      fclose (tmpfile);
-    }
+    fclose (tmpfile);
 
   user_file_remove (UFILE_AVAILABLE_NOTIFICATIONS_TMP);
 
+  validators_clear (&old_validators);
+  validators_clear (&new_validators);
   g_free (uri);
 
   return ok;
@@ -111,6 +111,10 @@ struct _HamUpdatesStatusMenuItemPrivate
   /* libconic */
   ConIcConnection *conic;
   ConState constate;
+  gboolean free_network;
+
+  /* updates waiting to be downloaded ahead */
+  gboolean prefetch_pending;
 
   /* osso display */
   osso_display_state_t display_state;
@@ -253,6 +257,8 @@ ham_updates_status_menu_item_init (HamUpdatesStatusMenuItem *self)
 
   priv->conic = NULL;
   priv->constate = CONN_OFFLINE;
+  priv->free_network = FALSE;
+  priv->prefetch_pending = FALSE;
 
   priv->icon = priv->no_icon = NULL;
 
@@ -340,6 +346,34 @@ get_http_proxy (HamUpdatesStatusMenuItem *self)
   return proxy;
 }
 
+/* Download the available updates ahead when they are pending, we are
+   on a network that doesn't cost anything and the device is idle.
+   The Application Manager is left alone; it does its own downloads.
+*/
+static void
+maybe_prefetch_updates (HamUpdatesStatusMenuItem *self)
+{
+  HamUpdatesStatusMenuItemPrivate *priv;
+  gchar *proxy;
+
+  priv = HAM_UPDATES_STATUS_MENU_ITEM_GET_PRIVATE (self);
+
+  if (!priv->prefetch_pending
+      || priv->constate != CONN_ONLINE
+      || !priv->free_network
+      || priv->display_state != OSSO_DISPLAY_OFF
+      || ham_is_running ())
+    return;
+
+  LOG ("Downloading the updates ahead");
+
+  proxy = get_http_proxy (self);
+  ham_updates_prefetch (priv->updates, proxy);
+  g_free (proxy);
+
+  priv->prefetch_pending = FALSE;
+}
+
 static void
 ham_updates_status_menu_item_check_done_cb (gpointer self,
                                             gboolean ok, gpointer data)
@@ -352,6 +386,10 @@ ham_updates_status_menu_item_check_done_cb (gpointer self,
     {
       LOG ("Check for updates done");
       update_state (self);
+
+      priv->prefetch_pending =
+        (ham_updates_get_prefetch_budget (priv->updates) > 0);
+      maybe_prefetch_updates (self);
     }
   else
     {
@@ -377,15 +415,17 @@ static void
 ham_updates_status_menu_item_map_event (GtkWidget *widget, gpointer data)
 {
   HamUpdatesStatusMenuItem *self;
+  HamUpdatesStatusMenuItemPrivate *priv;
 
   g_return_if_fail (IS_HAM_UPDATES_STATUS_MENU_ITEM (data));
 
   self = HAM_UPDATES_STATUS_MENU_ITEM (data);
+  priv = HAM_UPDATES_STATUS_MENU_ITEM_GET_PRIVATE (self);
 
   if (get_icon_state (self) == ICON_STATE_BLINKING)
     {
       /* let's update the tapped updates file */
-      ham_updates_icon_tapped ();
+      ham_updates_icon_tapped (priv->updates);
       ham_notifier_icon_tapped ();
 
       set_icon_state (self, ICON_STATE_STATIC);
@@ -446,6 +486,10 @@ ham_updates_status_menu_display_event_cb (osso_display_state_t state,
   /* Update display state */
   priv->display_state = state;
 
+  /* The screen going off is our cue that the device is idle */
+  if (state == OSSO_DISPLAY_OFF)
+    maybe_prefetch_updates (self);
+
   /* Check if it's needed to enable/disable blinking the icon */
   if (get_icon_state (self) == ICON_STATE_BLINKING)
     {
@@ -647,7 +691,18 @@ ham_updates_status_menu_item_inotify_cb (GIOChannel *source,
 
       event = (struct inotify_event *) &buf[i];
 
-      LOG ("inotify: %s", event->name);
+      LOG ("inotify: %s", event->len > 0 ? event->name : "");
+
+      /* Events have been lost, so anything might have changed.
+       */
+      if (event->mask & IN_Q_OVERFLOW)
+        {
+          ham_updates_file_changed (priv->updates, NULL);
+          update_state (HAM_UPDATES_STATUS_MENU_ITEM (data));
+        }
+      else if (event->len > 0
+          && (event->wd == priv->wd[VAR] || event->wd == priv->wd[HOME]))
+        ham_updates_file_changed (priv->updates, event->name);
 
       if (is_file_modified (event, priv->wd[VAR], AVAILABLE_UPDATES_FILE_NAME)
           || is_file_modified (event, priv->wd[HOME], UFILE_SEEN_UPDATES)
@@ -678,7 +733,7 @@ add_watch_for_path (HamUpdatesStatusMenuItem *self, const gchar *path)
   priv = HAM_UPDATES_STATUS_MENU_ITEM_GET_PRIVATE (self);
 
   watch = inotify_add_watch (priv->inotify_fd, path,
-                             IN_CLOSE_WRITE | IN_MOVED_TO);
+                             IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
 
   if (watch < 0)
     {
@@ -871,6 +926,22 @@ setup_alarm (HamUpdatesStatusMenuItem *self)
   return priv->alarm_cookie > 0;
 }
 
+static UpdatesStatus
+get_updates_status (HamUpdatesStatusMenuItem *self)
+{
+  HamUpdatesStatusMenuItemPrivate *priv;
+
+  priv = HAM_UPDATES_STATUS_MENU_ITEM_GET_PRIVATE (self);
+
+  /* Without inotify, we can't know when the files change and must
+     read them every time.
+  */
+  if (priv->inotify_fd == -1)
+    ham_updates_file_changed (priv->updates, NULL);
+
+  return ham_updates_status (priv->updates, priv->osso);
+}
+
 static gboolean
 should_force_check_for_updates (HamUpdatesStatusMenuItem *self)
 {
@@ -880,25 +951,15 @@ should_force_check_for_updates (HamUpdatesStatusMenuItem *self)
 
   /* Check the status of the updates */
   priv = HAM_UPDATES_STATUS_MENU_ITEM_GET_PRIVATE (self);
-  updates = ham_updates_status (priv->updates, priv->osso);
+  updates = get_updates_status (self);
   if (updates == UPDATES_NEW)
     {
-      gchar *tapped_updates_path;
-      struct stat buf;
-
       /* We need to distinguish if this is a normal use case
          (icon already blinking before) or if it's because we
-         should force a re-check now (no files on disk) */
-      tapped_updates_path =
-        g_strdup_printf ("%s/%s",
-                         user_file_get_state_dir_path (),
-                         UFILE_TAPPED_UPDATES);
-
-      /* If no tapped files, check-for-updates should be forced */
-      if (stat (tapped_updates_path, &buf) == -1)
+         should force a re-check now (no files on disk).  If no
+         tapped files, check-for-updates should be forced */
+      if (!ham_updates_have_tapped (priv->updates))
         retval = TRUE;
-
-      g_free (tapped_updates_path);
     }
 
   return retval;
@@ -1201,7 +1262,7 @@ update_state (HamUpdatesStatusMenuItem *self)
 
   g_object_get (G_OBJECT (self), "visible", &visible, NULL);
 
-  updates = ham_updates_status (priv->updates, priv->osso);
+  updates = get_updates_status (self);
   notification = ham_notifier_status (NULL);
 
   /* shall we show the updates button? */
@@ -1251,7 +1312,12 @@ ham_updates_status_menu_item_connection_cb (ConIcConnection *connection,
         priv->constate = CONN_ONLINE;
       else
         priv->constate = CONN_OFFLINE;
+
+      /* XXX - likewise, only WLAN is assumed to be free of charge. */
+      priv->free_network = (g_strstr_len (bearer, -1, "WLAN") != NULL);
     }
+  else
+    priv->free_network = FALSE;
 
   LOG ("we're %s", priv->constate == CONN_OFFLINE ? "offline" : "online");
 }
@@ -1268,6 +1334,7 @@ setup_connection_state (HamUpdatesStatusMenuItem *self)
       /* if we're in scratchbox will assume that we have an inet
          connection */
       priv->constate = CONN_ONLINE;
+      priv->free_network = TRUE;
       LOG ("we're online");
     }
   else
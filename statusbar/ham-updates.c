@@ -70,11 +70,30 @@ struct _HamUpdatesPrivate
 
   /* apt-worker spawn */
   guint child_id;
+  guint prefetch_id;
+
+  /* AVAILABLE_UPDATES_FILE, either mapped into memory or parsed when
+     it is still in the XML format, the parsed contents of the seen
+     and tapped user files, and the updates computed from them.  They
+     are read on demand and forgotten by ham_updates_file_changed.  A
+     missing file is represented by NULL.
+  */
+  xexp_map *available_updates_map;
+  xexp *available_updates;
+  GHashTable *seen_updates;
+  GHashTable *tapped_updates;
+  Updates *updates;
+  guint loaded;
 };
 
+#define LOADED_AVAILABLE (1 << 0)
+#define LOADED_SEEN      (1 << 1)
+#define LOADED_TAPPED    (1 << 2)
+#define LOADED_UPDATES   (1 << 3)
+
 static void ham_updates_build_button (HamUpdates *self);
 
-static Updates *updates_fetch (const gchar *seen_ufile);
+static Updates *updates_fetch (HamUpdates *self);
 static void updates_free (Updates* updates);
 
 static void ham_updates_finalize (gpointer object)
@@ -85,6 +104,11 @@ static void ham_updates_finalize (gpointer object)
 
   if (priv->child_id > 0)
     g_source_remove (priv->child_id);
+
+  if (priv->prefetch_id > 0)
+    g_source_remove (priv->prefetch_id);
+
+  ham_updates_file_changed (HAM_UPDATES (object), NULL);
 }
 
 static void
@@ -95,99 +119,274 @@ ham_updates_init (HamUpdates *self)
   priv = HAM_UPDATES_GET_PRIVATE (self);
 
   priv->child_id = 0;
+  priv->prefetch_id = 0;
+
+  priv->available_updates_map = NULL;
+  priv->available_updates = NULL;
+  priv->seen_updates = NULL;
+  priv->tapped_updates = NULL;
+  priv->updates = NULL;
+  priv->loaded = 0;
+
   ham_updates_build_button (self);
 }
 
-static void
-update_seen_file (const gchar *seen_ufile)
+/* Read the package names of the updates in UFILE into a new hash
+   set.  Return NULL when the file doesn't exist.
+*/
+static GHashTable *
+read_updates_set (const gchar *ufile)
 {
-  xexp *available_updates;
+  GHashTable *set;
+  xexp *updates;
+  xexp *x;
+
+  updates = user_file_read_xexp (ufile);
+  if (updates == NULL)
+    return NULL;
+
+  set = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
-  g_return_if_fail (seen_ufile != NULL);
+  if (xexp_is_list (updates))
+    for (x = xexp_first (updates); x != NULL; x = xexp_rest (x))
+      if (xexp_is_text (x))
+        g_hash_table_insert (set, g_strdup (xexp_text (x)), NULL);
+
+  xexp_free (updates);
+  return set;
+}
 
-  available_updates = xexp_read_file (AVAILABLE_UPDATES_FILE);
+typedef void AvailableUpdateFunc (const gchar *tag, const gchar *name,
+                                  gpointer data);
 
-  if (available_updates != NULL)
+/* Call FUNC for every update in AVAILABLE_UPDATES_FILE, with its
+   class as the tag.  Return FALSE when the file is missing.
+
+   The apt-worker writes the file in the binary xexp format and
+   replaces it atomically, so it is mapped and used in place instead
+   of being parsed.  A file that is still in the XML format, from an
+   older apt-worker, is read as usual.
+*/
+static gboolean
+foreach_available_update (HamUpdates *self,
+                          AvailableUpdateFunc *func, gpointer data)
+{
+  HamUpdatesPrivate *priv;
+
+  priv = HAM_UPDATES_GET_PRIVATE (self);
+
+  if (!(priv->loaded & LOADED_AVAILABLE))
     {
-      user_file_write_xexp (seen_ufile, available_updates);
-      xexp_free (available_updates);
+      priv->available_updates_map = xexp_map_file (AVAILABLE_UPDATES_FILE);
+      if (priv->available_updates_map == NULL)
+        priv->available_updates = xexp_read_file (AVAILABLE_UPDATES_FILE);
+      priv->loaded |= LOADED_AVAILABLE;
+    }
+
+  if (priv->available_updates_map != NULL)
+    {
+      const xexp_node *root = xexp_map_root (priv->available_updates_map);
+      const xexp_node *n;
+
+      for (n = xexp_node_first (root); n != NULL; n = xexp_node_rest (n))
+        if (xexp_node_is_text (n))
+          func (xexp_node_tag (n), xexp_node_text (n), data);
+    }
+  else if (priv->available_updates != NULL)
+    {
+      xexp *x;
+
+      if (xexp_is_list (priv->available_updates))
+        for (x = xexp_first (priv->available_updates);
+             x != NULL; x = xexp_rest (x))
+          if (xexp_is_text (x))
+            func (xexp_tag (x), xexp_text (x), data);
     }
+  else
+    return FALSE;
+
+  return TRUE;
 }
 
+typedef struct {
+  GHashTable *seen_updates;
+  xexp *list;
+} CollectClosure;
+
+/* Add the update NAME to the list of DATA unless it has been seen.
+ */
 static void
-clean_updates_ufile (const gchar *ufile)
+collect_unseen_update (const gchar *tag, const gchar *name, gpointer data)
 {
-  g_return_if_fail (ufile != NULL);
+  CollectClosure *c = (CollectClosure *) data;
 
-  xexp *updates = xexp_list_new ("updates");
+  if (c->seen_updates == NULL
+      || !g_hash_table_lookup_extended (c->seen_updates, name, NULL, NULL))
+    xexp_cons (c->list, xexp_text_new (tag, name));
+}
 
-  if (updates != NULL)
+static GHashTable *
+get_seen_updates (HamUpdates *self)
+{
+  HamUpdatesPrivate *priv;
+
+  priv = HAM_UPDATES_GET_PRIVATE (self);
+
+  if (!(priv->loaded & LOADED_SEEN))
     {
-      user_file_write_xexp (ufile, updates);
-      xexp_free (updates);
+      priv->seen_updates = read_updates_set (UFILE_SEEN_UPDATES);
+      priv->loaded |= LOADED_SEEN;
     }
+
+  return priv->seen_updates;
 }
 
+static GHashTable *
+get_tapped_updates (HamUpdates *self)
+{
+  HamUpdatesPrivate *priv;
+
+  priv = HAM_UPDATES_GET_PRIVATE (self);
+
+  if (!(priv->loaded & LOADED_TAPPED))
+    {
+      priv->tapped_updates = read_updates_set (UFILE_TAPPED_UPDATES);
+      priv->loaded |= LOADED_TAPPED;
+    }
+
+  return priv->tapped_updates;
+}
+
+/* The available updates that are not in the seen updates file.  The
+   result is owned by SELF.
+*/
+static Updates *
+get_updates (HamUpdates *self)
+{
+  HamUpdatesPrivate *priv;
+
+  priv = HAM_UPDATES_GET_PRIVATE (self);
+
+  if (!(priv->loaded & LOADED_UPDATES))
+    {
+      priv->updates = updates_fetch (self);
+      priv->loaded |= LOADED_UPDATES;
+    }
+
+  return priv->updates;
+}
+
+/* Forget what we know about the file NAME, which is either
+   AVAILABLE_UPDATES_FILE_NAME or the name of a user file, so that it
+   is read again when needed.  When NAME is NULL, forget everything.
+   The status menu item calls this from its inotify watch, so that
+   checking the status doesn't need to touch the disk.
+*/
 void
-ham_updates_icon_tapped ()
+ham_updates_file_changed (HamUpdates *self, const gchar *name)
 {
-  xexp *available_updates;
-  xexp *seen_updates;
-  xexp *tapped_updates;
+  HamUpdatesPrivate *priv;
+  gboolean all;
 
-  g_warning ("icon tapped!!");
+  priv = HAM_UPDATES_GET_PRIVATE (self);
+  all = (name == NULL);
 
-  available_updates = xexp_read_file (AVAILABLE_UPDATES_FILE);
-  if (available_updates == NULL)
+  if (all || strcmp (name, AVAILABLE_UPDATES_FILE_NAME) == 0)
     {
-      clean_updates_ufile (UFILE_TAPPED_UPDATES);
-      return;
+      xexp_unmap (priv->available_updates_map);
+      priv->available_updates_map = NULL;
+      if (priv->available_updates != NULL)
+        xexp_free (priv->available_updates);
+      priv->available_updates = NULL;
+      priv->loaded &= ~(LOADED_AVAILABLE | LOADED_UPDATES);
     }
 
-  seen_updates = user_file_read_xexp (UFILE_SEEN_UPDATES);
+  if (all || strcmp (name, UFILE_SEEN_UPDATES) == 0)
+    {
+      if (priv->seen_updates != NULL)
+        g_hash_table_destroy (priv->seen_updates);
+      priv->seen_updates = NULL;
+      priv->loaded &= ~(LOADED_SEEN | LOADED_UPDATES);
+    }
 
-  tapped_updates = xexp_list_new ("updates");
+  if (all || strcmp (name, UFILE_TAPPED_UPDATES) == 0)
+    {
+      if (priv->tapped_updates != NULL)
+        g_hash_table_destroy (priv->tapped_updates);
+      priv->tapped_updates = NULL;
+      priv->loaded &= ~LOADED_TAPPED;
+    }
 
-  if (tapped_updates != NULL)
+  if (!(priv->loaded & LOADED_UPDATES) && priv->updates != NULL)
     {
-      xexp *x;
-      xexp *y;
+      updates_free (priv->updates);
+      priv->updates = NULL;
+    }
+}
 
-      for (x = xexp_first (available_updates); x != NULL; x = xexp_rest (x))
-        {
-          if (!xexp_is_text (x))
-            continue;
+static void
+update_seen_file (HamUpdates *self)
+{
+  CollectClosure c;
 
-          y = NULL;
-          if ((seen_updates != NULL) && xexp_is_list (seen_updates))
-            {
-              const gchar *pkg;
+  c.seen_updates = NULL;
+  c.list = xexp_list_new ("updates");
 
-              pkg = xexp_text (x);
+  if (foreach_available_update (self, collect_unseen_update, &c))
+    {
+      xexp_reverse (c.list);
+      user_file_write_xexp (UFILE_SEEN_UPDATES, c.list);
+      ham_updates_file_changed (self, UFILE_SEEN_UPDATES);
+    }
 
-              for (y = xexp_first (seen_updates); y != NULL; y = xexp_rest (y))
-                if (xexp_is_text (y) && strcmp (pkg, xexp_text (y)) == 0)
-                  break;
-            }
+  xexp_free (c.list);
+}
 
-          /* this available_update is not in the seen_udpates */
-          if (y == NULL)
-            {
-              xexp *tapped = NULL;
-              tapped = xexp_text_new (xexp_tag (x), xexp_text (x));
-              xexp_cons (tapped_updates, tapped);
-            }
-        }
+static void
+clean_updates_ufile (HamUpdates *self, const gchar *ufile)
+{
+  g_return_if_fail (ufile != NULL);
+
+  xexp *updates = xexp_list_new ("updates");
+
+  if (updates != NULL)
+    {
+      user_file_write_xexp (ufile, updates);
+      xexp_free (updates);
+    }
+
+  ham_updates_file_changed (self, ufile);
+}
+
+/* Whether the tapped updates file exists.  Like the other files, it
+   is only looked at again after ham_updates_file_changed.
+*/
+gboolean
+ham_updates_have_tapped (HamUpdates *self)
+{
+  return get_tapped_updates (self) != NULL;
+}
+
+void
+ham_updates_icon_tapped (HamUpdates *self)
+{
+  CollectClosure c;
+
+  g_warning ("icon tapped!!");
 
-      user_file_write_xexp (UFILE_TAPPED_UPDATES, tapped_updates);
+  /* the available updates that are not in the seen updates */
+  c.seen_updates = get_seen_updates (self);
+  c.list = xexp_list_new ("updates");
 
-      if (tapped_updates != NULL)
-        xexp_free (tapped_updates);
+  if (foreach_available_update (self, collect_unseen_update, &c))
+    {
+      user_file_write_xexp (UFILE_TAPPED_UPDATES, c.list);
+      ham_updates_file_changed (self, UFILE_TAPPED_UPDATES);
     }
+  else
+    clean_updates_ufile (self, UFILE_TAPPED_UPDATES);
 
-  xexp_free (available_updates);
-  if (seen_updates != NULL)
-    xexp_free (seen_updates);
+  xexp_free (c.list);
 }
 
 static void
@@ -203,8 +402,8 @@ ham_updates_dialog_response_cb (GtkDialog *dialog,
     {
       if (response == GTK_RESPONSE_NO)
         {
-          update_seen_file (UFILE_SEEN_UPDATES);
-          clean_updates_ufile (UFILE_TAPPED_UPDATES);
+          update_seen_file (self);
+          clean_updates_ufile (self, UFILE_TAPPED_UPDATES);
         }
 
       gtk_widget_destroy (GTK_WIDGET (dialog));
@@ -255,12 +454,12 @@ build_category_string (GString *str, const gchar *title, GSList *list)
 }
 
 static gchar*
-build_dialog_content ()
+build_dialog_content (HamUpdates *self)
 {
   Updates *updates;
   gchar* retval;
 
-  updates = updates_fetch (UFILE_SEEN_UPDATES);
+  updates = get_updates (self);
   retval = NULL;
 
   if (updates == NULL)
@@ -284,7 +483,6 @@ build_dialog_content ()
       retval = g_string_free (str, FALSE);
     }
 
-  updates_free (updates);
   return retval;
 }
 
@@ -310,7 +508,7 @@ ham_updates_button_clicked_cb (GtkButton *button, gpointer data)
 
   self = HAM_UPDATES (data);
 
-  content = build_dialog_content ();
+  content = build_dialog_content (self);
 
   if (content != NULL)
     {
@@ -395,6 +593,10 @@ ham_updates_check_done_cb (GPid pid, gint status, gpointer data)
 
   ok = (status != -1 && WIFEXITED (status) && WEXITSTATUS (status) == 0);
 
+  if (status != -1 && WIFEXITED (status)
+      && WEXITSTATUS (status) == APT_WORKER_EXIT_BUSY)
+    LOG ("apt-worker is busy, leaving the check to it");
+
   if (ok == TRUE)
     save_last_update_time (time_get_time ());
 
@@ -423,6 +625,8 @@ ham_updates_maybe_force_blinking (HamUpdates *self)
             {
               user_file_remove (UFILE_SEEN_UPDATES);
               user_file_remove (UFILE_TAPPED_UPDATES);
+              ham_updates_file_changed (self, UFILE_SEEN_UPDATES);
+              ham_updates_file_changed (self, UFILE_TAPPED_UPDATES);
             }
         }
 
@@ -490,6 +694,93 @@ ham_updates_check (HamUpdates *self, gchar *proxy)
   return retval;
 }
 
+static void
+ham_updates_prefetch_done_cb (GPid pid, gint status, gpointer data)
+{
+  HamUpdatesPrivate *priv;
+
+  priv = HAM_UPDATES_GET_PRIVATE (data);
+
+  priv->prefetch_id = 0;
+  g_spawn_close_pid (pid);
+
+  if (status == -1 || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    LOG ("Downloading the updates ahead failed");
+}
+
+/* Download the archives of the available updates in the background,
+   so that installing them later doesn't need to wait for the network.
+   The caller is responsible for choosing a good moment for it.
+*/
+gboolean
+ham_updates_prefetch (HamUpdates *self, gchar *proxy)
+{
+  HamUpdatesPrivate *priv;
+  gchar *gainroot_cmd;
+  gchar *budget;
+  GPid pid;
+  GError *error;
+  gboolean retval;
+  gint budget_mb;
+
+  priv = HAM_UPDATES_GET_PRIVATE (self);
+
+  /* Already running */
+  if (priv->prefetch_id > 0)
+    return TRUE;
+
+  budget_mb = ham_updates_get_prefetch_budget (self);
+  if (budget_mb <= 0)
+    return FALSE;
+
+  /* Choose the right gainroot command */
+  if (running_in_scratchbox ())
+    gainroot_cmd = g_strdup ("/usr/bin/fakeroot");
+  else
+    gainroot_cmd = g_strdup ("/usr/bin/sudo");
+
+  budget = g_strdup_printf ("%lld", (long long) budget_mb * 1024 * 1024);
+
+  /* Build command to be spawned */
+  gchar *argv[] = {
+    gainroot_cmd,
+    "/usr/libexec/apt-worker",
+    "download-updates",
+    budget,
+    proxy,
+    NULL
+  };
+
+  error = NULL;
+  if (!g_spawn_async_with_pipes (NULL,
+				 argv,
+				 NULL,
+				 G_SPAWN_DO_NOT_REAP_CHILD,
+				 NULL,
+				 NULL,
+				 &pid,
+				 NULL,
+				 NULL,
+				 NULL,
+				 &error))
+    {
+      fprintf (stderr, "can't run %s: %s\n", argv[0], error->message);
+      g_error_free (error);
+      retval = FALSE;
+    }
+  else
+    {
+      priv->prefetch_id = g_child_watch_add (pid, ham_updates_prefetch_done_cb,
+                                             self);
+      retval = TRUE;
+    }
+
+  g_free (budget);
+  g_free (gainroot_cmd);
+
+  return retval;
+}
+
 time_t
 ham_updates_get_blink_after (HamUpdates *self)
 {
@@ -545,6 +836,36 @@ ham_updates_get_interval (HamUpdates *self)
   return interval * 60; /* in seconds */
 }
 
+/* The budget for downloading updates ahead, in MiB.  Zero disables
+   downloading ahead.
+*/
+gint
+ham_updates_get_prefetch_budget (HamUpdates *self)
+{
+  GConfClient *gconf;
+  GConfValue *value;
+  gint budget;
+
+  gconf = gconf_client_get_default ();
+
+  if (gconf == NULL)
+    return UPNO_DEFAULT_PREFETCH_BUDGET;
+
+  value = gconf_client_get (gconf, UPNO_GCONF_PREFETCH_BUDGET, NULL);
+
+  if (value != NULL && value->type == GCONF_VALUE_INT)
+    budget = gconf_value_get_int (value);
+  else
+    budget = UPNO_DEFAULT_PREFETCH_BUDGET;
+
+  if (value != NULL)
+    gconf_value_free (value);
+
+  g_object_unref (gconf);
+
+  return budget;
+}
+
 gboolean
 ham_updates_set_alarm (HamUpdates *self, alarm_event_t *event)
 {
@@ -662,72 +983,30 @@ ham_is_showing_check_for_updates_view (osso_context_t *context)
   return FALSE;
 }
 
+/* Whether there are updates that have neither been seen nor tapped.
+ */
 static gboolean
-is_there_unseen_updates (const gchar *seen_ufile, const gchar *tapped_ufile)
+is_there_unseen_updates (HamUpdates *self, Updates *updates)
 {
-  xexp *tapped_updates = NULL;
-  xexp *available_updates = NULL;
-  xexp *seen_updates = NULL;
-  gboolean ret = TRUE;
-
-  /* not really necessary because it's an internal function */
-  g_return_val_if_fail (seen_ufile != NULL && tapped_ufile != NULL, FALSE);
-
-  available_updates = xexp_read_file (AVAILABLE_UPDATES_FILE);
-  if (available_updates == NULL)
-    return FALSE;
+  GHashTable *tapped_updates;
+  GSList *lists[3];
+  GSList *l;
+  gint i;
 
-  tapped_updates = user_file_read_xexp (tapped_ufile);
+  tapped_updates = get_tapped_updates (self);
   if (tapped_updates == NULL)
-    goto bailout;
-
-  seen_updates = user_file_read_xexp (seen_ufile);
-
-  xexp *x;
-  xexp *y;
-  ret = FALSE;
-
-  for (x = xexp_first (available_updates); x != NULL; x = xexp_rest (x))
-    {
-      const gchar *pkg;
-
-      if (!xexp_is_text (x))
-        continue;
-
-      pkg = xexp_text (x);
-
-      /* filter out seen updates */
-      if ((seen_updates != NULL) && xexp_is_list (seen_updates))
-        {
-          for (y = xexp_first (seen_updates); y != NULL; y = xexp_rest (y))
-            if (xexp_is_text (y) && strcmp (pkg, xexp_text (y)) == 0)
-              break;
-
-          if (y != NULL)
-            continue; /* we have seen this update, go for the next item */
-        }
-
-      /* filter out tapped updates */
-      for (y = xexp_first (tapped_updates); y != NULL; y = xexp_rest (y))
-        if (xexp_is_text (y) && strcmp (pkg, xexp_text (y)) == 0)
-          break;
+    return TRUE;
 
-      if (y != NULL)
-        continue; /* we have tapped this update, go for the next item */
+  lists[0] = updates->os;
+  lists[1] = updates->certified;
+  lists[2] = updates->other;
 
-      /* when we reach these lines we found a new package :-) */
-      ret = TRUE;
-      break;
-    }
-
- bailout:
-  xexp_free (available_updates);
-  if (tapped_updates != NULL)
-    xexp_free (tapped_updates);
-  if (seen_updates != NULL)
-    xexp_free (seen_updates);
+  for (i = 0; i < 3; i++)
+    for (l = lists[i]; l != NULL; l = l->next)
+      if (!g_hash_table_lookup_extended (tapped_updates, l->data, NULL, NULL))
+        return TRUE;
 
-  return ret;
+  return FALSE;
 }
 
 UpdatesStatus
@@ -742,7 +1021,7 @@ ham_updates_status (HamUpdates *self, osso_context_t *context)
 
   priv = HAM_UPDATES_GET_PRIVATE (self);
 
-  updates = updates_fetch (UFILE_SEEN_UPDATES);
+  updates = get_updates (self);
 
   if (updates == NULL)
     {
@@ -760,90 +1039,62 @@ ham_updates_status (HamUpdates *self, osso_context_t *context)
 	  hildon_button_set_value (HILDON_BUTTON (priv->button), value);
 	  g_free (value);
 
-          if (is_there_unseen_updates (UFILE_SEEN_UPDATES,
-                                       UFILE_TAPPED_UPDATES))
+          if (is_there_unseen_updates (self, updates))
             ret = UPDATES_NEW;
           else
             ret = UPDATES_TAPPED;
 
-          updates_free (updates);
-
 	  return ret;
 	}
     }
 
-  updates_free (updates);
-
   return ret;
 }
 
-static Updates *
-updates_fetch (const gchar *seen_ufile)
-{
-  xexp *available_updates;
-  xexp *seen_updates;
-  Updates *retval;
-
-  g_return_val_if_fail (seen_ufile != NULL, NULL);
-
-  retval = g_new0 (Updates, 1);
-
-  available_updates = xexp_read_file (AVAILABLE_UPDATES_FILE);
-
-  if (available_updates == NULL)
-    goto exit;
-
-  seen_updates = user_file_read_xexp (seen_ufile);
-
-  if (seen_updates == NULL)
-    seen_updates = xexp_list_new ("updates");
-
-  /* preconditions ok */
-  {
-    xexp *x;
-    xexp *y;
+typedef struct {
+  GHashTable *seen_updates;
+  Updates *updates;
+} FetchClosure;
 
-    y = NULL;
+static void
+fetch_unseen_update (const gchar *tag, const gchar *name, gpointer data)
+{
+  FetchClosure *c = (FetchClosure *) data;
+  Updates *retval = c->updates;
 
-    for (x = xexp_first (available_updates); x != NULL; x = xexp_rest (x))
-      {
-        if (!xexp_is_text (x))
-          continue;
+  if (c->seen_updates != NULL
+      && g_hash_table_lookup_extended (c->seen_updates, name, NULL, NULL))
+    return;
 
-        if ((seen_updates != NULL) && xexp_is_list (seen_updates))
-          {
-            const gchar *pkg;
+  retval->total++;
 
-            pkg = xexp_text (x);
+  if (strcmp (tag, "os") == 0)
+    retval->os = g_slist_prepend (retval->os, g_strdup (name));
+  else if (strcmp (tag, "certified") == 0)
+    retval->certified = g_slist_prepend (retval->certified, g_strdup (name));
+  else
+    retval->other = g_slist_prepend (retval->other, g_strdup (name));
+}
 
-            for (y = xexp_first (seen_updates); y != NULL; y = xexp_rest (y))
-              if (xexp_is_text (y) && strcmp (pkg, xexp_text (y)) == 0)
-                break;
-          }
+static Updates *
+updates_fetch (HamUpdates *self)
+{
+  Updates *retval;
+  FetchClosure c;
 
-        if (y == NULL)
-          {
-            retval->total++;
+  retval = g_new0 (Updates, 1);
 
-            if (xexp_is (x, "os"))
-              retval->os = g_slist_append (retval->os,
-                                           g_strdup (xexp_text (x)));
-            else if (xexp_is (x, "certified"))
-              retval->certified = g_slist_append (retval->certified,
-                                                  g_strdup (xexp_text (x)));
-            else
-              retval->other = g_slist_append (retval->other,
-                                              g_strdup (xexp_text (x)));
-	  }
-      }
+  c.seen_updates = get_seen_updates (self);
+  c.updates = retval;
 
-      xexp_free (available_updates);
+  if (!foreach_available_update (self, fetch_unseen_update, &c))
+    goto exit;
 
-      if (seen_updates != NULL)
-        xexp_free (seen_updates);
-    }
+  retval->os = g_slist_reverse (retval->os);
+  retval->certified = g_slist_reverse (retval->certified);
+  retval->other = g_slist_reverse (retval->other);
 
-  if (retval != NULL && retval->total > 0)
+  if (retval->total > 0)
     LOG ("new pkgs = %d, os = %d, cert = %d, other = %d", retval->total,
 	 g_slist_length (retval->os),
 	 g_slist_length (retval->certified),
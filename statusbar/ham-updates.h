@@ -53,12 +53,16 @@ struct _HamUpdates
 };
 
 gboolean ham_updates_check (HamUpdates *self, gchar *proxy);
+gboolean ham_updates_prefetch (HamUpdates *self, gchar *proxy);
 gboolean ham_updates_set_alarm (HamUpdates *self, alarm_event_t *event);
 GtkWidget *ham_updates_get_button (HamUpdates *self);
 time_t ham_updates_get_blink_after (HamUpdates *self);
 time_t ham_updates_get_interval (HamUpdates *self);
+gint ham_updates_get_prefetch_budget (HamUpdates *self);
 UpdatesStatus ham_updates_status (HamUpdates *self, osso_context_t *context);
-void ham_updates_icon_tapped ();
+void ham_updates_icon_tapped (HamUpdates *self);
+gboolean ham_updates_have_tapped (HamUpdates *self);
+void ham_updates_file_changed (HamUpdates *self, const gchar *name);
 
 HamUpdates *ham_updates_new (gpointer data);
 void ham_updates_free (HamUpdates *self);
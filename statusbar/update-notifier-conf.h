@@ -27,8 +27,10 @@
 #define UPNO_GCONF_DIR              "/apps/hildon/update-notifier"
 #define UPNO_GCONF_BLINK_AFTER      UPNO_GCONF_DIR "/blink-after"
 #define UPNO_GCONF_CHECK_INTERVAL   UPNO_GCONF_DIR "/check_interval"
+#define UPNO_GCONF_PREFETCH_BUDGET  UPNO_GCONF_DIR "/prefetch_budget"
 #define UPNO_DEFAULT_BLINK_AFTER    (24 * 60)      /* minutes */
 #define UPNO_DEFAULT_CHECK_INTERVAL (24 * 60)      /* minutes */
+#define UPNO_DEFAULT_PREFETCH_BUDGET 50            /* MiB, 0 disables */
 
 #define UPDATE_NOTIFIER_SERVICE "com.nokia.hildon_update_notifier"
 #define UPDATE_NOTIFIER_OBJECT_PATH "/com/nokia/hildon_update_notifier"
@@ -44,6 +46,12 @@
 #define HILDON_APP_MGR_OP_SHOW_CHECK_FOR_UPDATES "show_check_for_updates_view"
 #define HILDON_APP_MGR_OP_SHOWING_CHECK_FOR_UPDATES "showing_check_for_updates_view"
 
+/* The exit code of "apt-worker check-for-updates" when the backend of
+   the Application Manager is running, and it should be asked to do
+   the check instead.
+*/
+#define APT_WORKER_EXIT_BUSY 3
+
 #define AVAILABLE_UPDATES_FILE_NAME "available-updates"
 #define AVAILABLE_UPDATES_FILE "/var/lib/hildon-application-manager/" AVAILABLE_UPDATES_FILE_NAME
 